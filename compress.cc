@@ -0,0 +1,135 @@
+#include "compress.h"
+#include <string.h>
+
+// Escreve a parte do tamanho que não coube nos 4 bits do token (sequência de 255 terminada por um byte < 255)
+int LZ_Codec::put_length(char *dst, int pos, int capacity, int length)
+{
+    while (length >= 255) {
+        if (pos >= capacity) return 0;
+        dst[pos++] = (char) 255;
+        length -= 255;
+    }
+    if (pos >= capacity) return 0;
+    dst[pos++] = (char) length;
+    return pos;
+}
+
+int LZ_Codec::compress(const char *src, int length, char *dst, int capacity)
+{
+    int table[1 << HASH_BITS]; // Última posição vista de cada hash de 4 bytes
+    for (int i = 0; i < (1 << HASH_BITS); i++) {
+        table[i] = -1;
+    }
+
+    int ip = 0, anchor = 0, op = 0;
+
+    while (ip + MIN_MATCH <= length) {
+        unsigned int seq;
+        memcpy(&seq, src + ip, sizeof(seq));
+        unsigned int h = (seq * 2654435761u) >> (32 - HASH_BITS);
+
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > MAX_OFFSET || memcmp(src + ref, src + ip, MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        // Estende o match o quanto der
+        int match = MIN_MATCH;
+        while (ip + match < length && src[ref + match] == src[ip + match]) {
+            match++;
+        }
+
+        int literals = ip - anchor;
+
+        if (op >= capacity) return 0;
+        int token = op++;
+        dst[token] = (char) (((literals < 15 ? literals : 15) << 4) |
+                             (match - MIN_MATCH < 15 ? match - MIN_MATCH : 15));
+
+        if (literals >= 15 && !(op = put_length(dst, op, capacity, literals - 15))) return 0;
+
+        if (op + literals + 2 > capacity) return 0;
+        memcpy(dst + op, src + anchor, literals);
+        op += literals;
+
+        int offset = ip - ref;
+        dst[op++] = (char) (offset & 0xff);
+        dst[op++] = (char) (offset >> 8);
+
+        if (match - MIN_MATCH >= 15 && !(op = put_length(dst, op, capacity, match - MIN_MATCH - 15))) return 0;
+
+        ip += match;
+        anchor = ip;
+    }
+
+    // Última sequência: só literais
+    int literals = length - anchor;
+
+    if (op >= capacity) return 0;
+    dst[op++] = (char) ((literals < 15 ? literals : 15) << 4);
+
+    if (literals >= 15 && !(op = put_length(dst, op, capacity, literals - 15))) return 0;
+
+    if (op + literals > capacity) return 0;
+    memcpy(dst + op, src + anchor, literals);
+    op += literals;
+
+    return op;
+}
+
+int LZ_Codec::decompress(const char *src, int length, char *dst, int capacity)
+{
+    const unsigned char *in = (const unsigned char *) src;
+    int ip = 0, op = 0;
+
+    while (ip < length) {
+        int token = in[ip++];
+
+        int literals = token >> 4;
+        if (literals == 15) {
+            int b;
+            do {
+                if (ip >= length) return 0;
+                b = in[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+
+        if (ip + literals > length || op + literals > capacity) return 0;
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+
+        // A última sequência não tem match
+        if (ip == length) break;
+
+        if (ip + 2 > length) return 0;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > op) return 0;
+
+        int match = token & 15;
+        if (match == 15) {
+            int b;
+            do {
+                if (ip >= length) return 0;
+                b = in[ip++];
+                match += b;
+            } while (b == 255);
+        }
+        match += MIN_MATCH;
+
+        if (op + match > capacity) return 0;
+
+        // Cópia byte a byte, já que o match pode se sobrepor ao que está sendo escrito
+        for (int i = 0; i < match; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op;
+}
@@ -0,0 +1,22 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Compressor LZ77 no estilo do LZ4: cada sequência é um token (4 bits de tamanho de literais e
+// 4 bits de tamanho de match), os literais, e um deslocamento de 2 bytes para o match.
+// Pensado para blocos pequenos (até 64 KiB), comprimidos de forma independente.
+class LZ_Codec
+{
+public:
+    // Retornam o tamanho da saída ou 0 se ela não couber em capacity (ou a entrada for inválida)
+    static int compress(const char *src, int length, char *dst, int capacity);
+    static int decompress(const char *src, int length, char *dst, int capacity);
+
+private:
+    static const int MIN_MATCH = 4;
+    static const int HASH_BITS = 12;
+    static const int MAX_OFFSET = 65535;
+
+    static int put_length(char *dst, int pos, int capacity, int length);
+};
+
+#endif
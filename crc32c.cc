@@ -0,0 +1,117 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+CRC32C::tables::tables()
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        }
+        bytes[i] = c;
+    }
+
+    // O CRC é linear: avançar c por LANE zeros é o xor do avanço de cada um dos seus bits
+    unsigned int bit[32];
+    for (int b = 0; b < 32; b++) {
+        unsigned int c = 1u << b;
+        for (size_t n = 0; n < LANE; n++) {
+            c = bytes[c & 0xff] ^ (c >> 8);
+        }
+        bit[b] = c;
+    }
+
+    for (int k = 0; k < 4; k++) {
+        for (unsigned int i = 0; i < 256; i++) {
+            shift[k][i] = 0;
+            for (int b = 0; b < 8; b++) {
+                if (i & (1u << b)) shift[k][i] ^= bit[8 * k + b];
+            }
+        }
+    }
+}
+
+// Estático local: inicializado uma vez só, mesmo com várias threads lendo ao mesmo tempo
+const CRC32C::tables &CRC32C::get_tables()
+{
+    static const tables t;
+    return t;
+}
+
+unsigned int CRC32C::shift_lane(const tables &t, unsigned int crc)
+{
+    return t.shift[0][crc & 0xff] ^ t.shift[1][(crc >> 8) & 0xff] ^
+           t.shift[2][(crc >> 16) & 0xff] ^ t.shift[3][crc >> 24];
+}
+
+unsigned int CRC32C::compute_table(const unsigned char *p, size_t length, unsigned int crc)
+{
+    const tables &t = get_tables();
+
+    for (size_t i = 0; i < length; i++) {
+        crc = t.bytes[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// A instrução crc32 leva 3 ciclos mas aceita uma nova por ciclo, então três faixas independentes
+// andam juntas; no fim de cada volta a primeira é avançada duas faixas, a segunda uma, e tudo vira um CRC só.
+__attribute__((target("sse4.2")))
+unsigned int CRC32C::compute_sse42(const unsigned char *p, size_t length, unsigned int crc)
+{
+    const tables &t = get_tables();
+    unsigned long long c0 = crc;
+
+    for (; length >= 3 * LANE; p += 3 * LANE, length -= 3 * LANE) {
+        unsigned long long c1 = 0, c2 = 0;
+        for (size_t i = 0; i < LANE; i += 8) {
+            unsigned long long v0, v1, v2;
+            memcpy(&v0, p + i, sizeof(v0));
+            memcpy(&v1, p + LANE + i, sizeof(v1));
+            memcpy(&v2, p + 2 * LANE + i, sizeof(v2));
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c0 = shift_lane(t, shift_lane(t, (unsigned int) c0) ^ (unsigned int) c1) ^ (unsigned int) c2;
+    }
+
+    for (; length >= 8; p += 8, length -= 8) {
+        unsigned long long v;
+        memcpy(&v, p, sizeof(v));
+        c0 = _mm_crc32_u64(c0, v);
+    }
+
+    crc = (unsigned int) c0;
+    for (; length > 0; p++, length--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#else
+unsigned int CRC32C::compute_sse42(const unsigned char *p, size_t length, unsigned int crc)
+{
+    return compute_table(p, length, crc);
+}
+#endif
+
+unsigned int CRC32C::compute(const void *data, size_t length, unsigned int crc)
+{
+#ifdef CRC32C_HAVE_SSE42
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+#else
+    static const bool sse42 = false;
+#endif
+
+    const unsigned char *p = (const unsigned char *) data;
+
+    crc = ~crc;
+    crc = sse42 ? compute_sse42(p, length, crc) : compute_table(p, length, crc);
+    return ~crc;
+}
@@ -0,0 +1,32 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+
+// CRC32C (polinômio de Castagnoli), o mesmo do iSCSI/ext4/btrfs. Usa a instrução crc32 do SSE4.2
+// quando o processador tem, senão uma tabela de 256 entradas. As duas dão o mesmo resultado,
+// então uma imagem escrita numa máquina pode ser verificada em outra.
+class CRC32C
+{
+public:
+    static unsigned int compute(const void *data, size_t length, unsigned int crc = 0);
+
+private:
+    static const unsigned int POLY = 0x82f63b78; // Polinômio refletido
+    static const size_t LANE = 1024; // Bytes de cada uma das três faixas calculadas em paralelo
+
+    class tables {
+        public:
+            tables();
+
+            unsigned int bytes[256]; // CRC de cada valor de byte
+            unsigned int shift[4][256]; // Avança um CRC por LANE bytes zero, um byte dele de cada vez
+    };
+
+    static const tables &get_tables();
+    static unsigned int shift_lane(const tables &t, unsigned int crc);
+    static unsigned int compute_table(const unsigned char *p, size_t length, unsigned int crc);
+    static unsigned int compute_sse42(const unsigned char *p, size_t length, unsigned int crc);
+};
+
+#endif
@@ -1,8 +1,33 @@
 #include "disk.h"
+#include "crc32c.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
 
-Disk::Disk(const char *filename, int n)
+Disk::Disk()
 {
+	diskfile = 0;
+	verbose = true;
+	nblocks = 0;
+	blocksize = DISK_BLOCK_SIZE;
+	nreads = 0;
+	nwrites = 0;
+	checksum_pending = 0;
+	nverified = 0;
+	verify_ns = 0;
+}
+
+Disk::~Disk()
+{
+}
+
+Disk::Disk(const char *filename, int n, int bs)
+{
+	verbose = true;
 	diskfile = fopen(filename, "r+");
 
 	if(!diskfile) 
@@ -13,11 +38,21 @@ Disk::Disk(const char *filename, int n)
 		return;
 	}
 
-	ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+	// Só aumenta a imagem: abrir com outro tamanho de bloco não pode cortar o que já está nela
+	struct stat st;
+	if(fstat(fileno(diskfile), &st) < 0 || st.st_size < (off_t) n * bs)
+		ftruncate(fileno(diskfile), (off_t) n * bs);
 
     nblocks = n;
+    blocksize = bs;
     nreads = 0;
     nwrites = 0;
+    checksum_pending = 0;
+    nverified = 0;
+    verify_ns = 0;
+
+	// Imagens que já têm região de checksums continuam sendo verificadas
+	checksum_load();
 }
 
 int Disk::size()
@@ -25,6 +60,11 @@ int Disk::size()
 	return nblocks;
 }
 
+int Disk::block_size()
+{
+	return blocksize;
+}
+
 void Disk::sanity_check( int blocknum, const void *data )
 {
 	if(blocknum < 0) {
@@ -47,38 +87,453 @@ void Disk::read(int blocknum, char *data )
 {
 	sanity_check(blocknum, data);
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+    fseeko(diskfile, (off_t) blocknum * blocksize, SEEK_SET);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
+	if(fread(data,blocksize,1,diskfile)==1) {
 		nreads++;
 	} else {
 		cout << "ERROR: couldn't access simulated disk\n";
 		abort();
 	}
+
+	if(!checksums.empty())
+		checksum_verify(blocknum, data);
 }
 
 void Disk::write(int blocknum, const char *data)
 {
 	sanity_check(blocknum, data);
 
-    fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!checksums.empty())
+		checksum_mark(blocknum);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
+    fseeko(diskfile,(off_t) blocknum*blocksize,SEEK_SET);
+
+	if(fwrite(data,blocksize,1,diskfile)==1) {
 		nwrites++;
 	} else {
 		cout << "ERROR: couldn't access simulated disk\n";
 		abort();
 	}
-	
+
+	if(!checksums.empty())
+		checksum_update(blocknum, data);
+}
+
+// Copia length bytes a partir do bloco blocknum direto para fd, sem passar pelo buffer do stdio.
+// Tenta copy_file_range, depois sendfile e só por último uma cópia com buffer.
+// Com fdoffset, escreve nessa posição de fd (e a avança) em vez de usar a posição atual dele.
+int Disk::export_blocks(int blocknum, int length, int fd, off_t *fdoffset)
+{
+	int count = (length + blocksize - 1) / blocksize;
+
+	sanity_check(blocknum, &fd);
+	sanity_check(blocknum + count - 1, &fd);
+
+	// Com checksums cada bloco precisa passar por read para ser verificado
+	if(!checksums.empty()) {
+		vector<char> buffer(blocksize);
+		int done = 0;
+		while(done < length) {
+			read(blocknum + done / blocksize, buffer.data());
+			int n = min(blocksize, length - done);
+			if(fdoffset) {
+				if(pwrite(fd, buffer.data(), n, *fdoffset) != n) break;
+				*fdoffset += n;
+			} else if(::write(fd, buffer.data(), n) != n) break;
+			done += n;
+		}
+		return done;
+	}
+
+	fflush(diskfile);
+
+	int imgfd = fileno(diskfile);
+	off_t offset = (off_t) blocknum * blocksize;
+	off_t end = offset + length;
+	ssize_t result = -1;
+
+	while(offset < end) {
+		result = copy_file_range(imgfd, &offset, fd, fdoffset, end - offset, 0);
+		if(result <= 0) break;
+	}
+
+	if(offset < end && result < 0 && !fdoffset) {
+		do {
+			result = sendfile(fd, imgfd, &offset, end - offset);
+		} while(result > 0 && offset < end);
+	}
+
+	if(offset < end && result < 0) {
+		char buffer[DISK_BLOCK_SIZE];
+		while(offset < end) {
+			result = pread(imgfd, buffer, min((off_t) DISK_BLOCK_SIZE, end - offset), offset);
+			if(result <= 0) break;
+			if(fdoffset) {
+				if(pwrite(fd, buffer, result, *fdoffset) != result) break;
+				*fdoffset += result;
+			} else if(::write(fd, buffer, result) != result) break;
+			offset += result;
+		}
+	}
+
+	int done = length - (end - offset);
+	nreads += (done + blocksize - 1) / blocksize;
+
+	return done;
+}
+
+// Copia length bytes lidos de fd direto para o disco a partir do bloco blocknum.
+// Com fdoffset, lê dessa posição de fd (e a avança) em vez de usar a posição atual dele.
+int Disk::import_blocks(int blocknum, int length, int fd, off_t *fdoffset)
+{
+	int count = (length + blocksize - 1) / blocksize;
+
+	sanity_check(blocknum, &fd);
+	sanity_check(blocknum + count - 1, &fd);
+
+	// Com checksums cada bloco passa por write para ter o checksum atualizado;
+	// o último, se incompleto, mantém o resto do conteúdo que já tinha
+	if(!checksums.empty()) {
+		vector<char> buffer(blocksize);
+		int done = 0;
+		while(done < length) {
+			int b = blocknum + done / blocksize;
+			int n = min(blocksize, length - done);
+			if(n < blocksize) read(b, buffer.data());
+			ssize_t result;
+			int got = 0;
+			do {
+				if(fdoffset) {
+					result = pread(fd, buffer.data() + got, n - got, *fdoffset);
+					if(result > 0) *fdoffset += result;
+				} else {
+					result = ::read(fd, buffer.data() + got, n - got);
+				}
+				if(result > 0) got += result;
+			} while(result > 0 && got < n);
+			if(got < n) break;
+			write(b, buffer.data());
+			done += n;
+		}
+		return done;
+	}
+
+	fflush(diskfile);
+
+	int imgfd = fileno(diskfile);
+	off_t offset = (off_t) blocknum * blocksize;
+	off_t end = offset + length;
+	ssize_t result = -1;
+
+	while(offset < end) {
+		result = copy_file_range(fd, fdoffset, imgfd, &offset, end - offset, 0);
+		if(result <= 0) break;
+	}
+
+	if(offset < end && result < 0 && lseek(imgfd, offset, SEEK_SET) == offset) {
+		do {
+			result = sendfile(imgfd, fd, fdoffset, end - offset);
+			if(result > 0) offset += result;
+		} while(result > 0 && offset < end);
+	}
+
+	if(offset < end && result < 0) {
+		char buffer[DISK_BLOCK_SIZE];
+		while(offset < end) {
+			if(fdoffset) {
+				result = pread(fd, buffer, min((off_t) DISK_BLOCK_SIZE, end - offset), *fdoffset);
+				if(result > 0) *fdoffset += result;
+			} else {
+				result = ::read(fd, buffer, min((off_t) DISK_BLOCK_SIZE, end - offset));
+			}
+			if(result <= 0) break;
+			if(pwrite(imgfd, buffer, result, offset) != result) break;
+			offset += result;
+		}
+	}
+
+	// Descarta o que o stdio tinha em buffer, já que o arquivo mudou por baixo dele
+	fflush(diskfile);
+
+	int done = length - (end - offset);
+	nwrites += (done + blocksize - 1) / blocksize;
+
+	return done;
+}
+
+// Checksums ficam numa região depois do último bloco: um checksum_header, um CRC32C (4 bytes) por bloco
+// e um registro com um byte por página de checksums. São verificados em toda leitura e, nas escritas,
+// atualizados em memória e gravados em lotes de páginas. Antes de um bloco mudar, a página dele é marcada
+// no registro, e a marca só sai depois que a página é gravada. O cabeçalho fica com clean = 0 enquanto a
+// imagem está aberta; se o programa morrer no meio, só as páginas marcadas são recalculadas na próxima
+// abertura, e as demais continuam acusando qualquer bloco corrompido.
+int Disk::enable_checksums(bool enable)
+{
+	if(!diskfile)
+		return 0;
+
+	if(!enable) {
+		if(checksums.empty())
+			return 1;
+
+		checksum_header header;
+		memset(&header, 0, sizeof(header));
+		fflush(diskfile);
+		if(pwrite(fileno(diskfile), &header, sizeof(header), (off_t) nblocks * blocksize) != sizeof(header))
+			return 0;
+
+		checksums.clear();
+		checksum_dirty.clear();
+		checksum_logged.clear();
+		checksum_pending = 0;
+		return 1;
+	}
+
+	if(!checksums.empty() || checksum_load())
+		return 1;
+
+	return checksum_rebuild();
+}
+
+// Calcula o checksum de todos os blocos e grava a região inteira (o registro vai zerado, já que
+// todas as páginas contam como marcadas até a gravação)
+int Disk::checksum_rebuild()
+{
+	checksums.assign(nblocks, 0);
+	checksum_dirty.assign((nblocks + CHECKSUMS_PER_PAGE - 1) / CHECKSUMS_PER_PAGE, true);
+	checksum_logged.assign(checksum_dirty.size(), 1);
+
+	vector<char> buffer(blocksize);
+	fflush(diskfile);
+	for(int i = 0; i < nblocks; i++) {
+		if(pread(fileno(diskfile), buffer.data(), blocksize, (off_t) i * blocksize) != blocksize) {
+			checksums.clear();
+			checksum_dirty.clear();
+			checksum_logged.clear();
+			return 0;
+		}
+		checksums[i] = CRC32C::compute(buffer.data(), blocksize);
+	}
+
+	checksum_flush(false);
+	return 1;
+}
+
+// Carrega a região de checksums, se a imagem tiver uma válida para este tamanho
+int Disk::checksum_load()
+{
+	if(!diskfile)
+		return 0;
+
+	int imgfd = fileno(diskfile);
+	off_t region = (off_t) nblocks * blocksize;
+
+	checksum_header header;
+	fflush(diskfile);
+	if(pread(imgfd, &header, sizeof(header), region) != sizeof(header) || header.magic != DISK_MAGIC ||
+	   header.nblocks != nblocks || header.blocksize != blocksize)
+		return 0;
+
+	int npages = (nblocks + CHECKSUMS_PER_PAGE - 1) / CHECKSUMS_PER_PAGE;
+	checksums.assign(nblocks, 0);
+	checksum_dirty.assign(npages, false);
+	checksum_logged.assign(npages, 0);
+
+	ssize_t bytes = (ssize_t) nblocks * sizeof(unsigned int);
+	if(pread(imgfd, checksums.data(), bytes, region + sizeof(header)) != bytes) {
+		checksums.clear();
+		checksum_dirty.clear();
+		checksum_logged.clear();
+		return 0;
+	}
+
+	// Fechada sem gravar os checksums: só os blocos das páginas marcadas no registro podem ter mudado
+	// sem o checksum acompanhar, então só eles são recalculados (e aceitos como estão)
+	if(!header.clean) {
+		vector<char> log(npages);
+		if(pread(imgfd, log.data(), npages, checksum_log_offset()) != npages) {
+			cout << "checksums were not saved on last close and there is no log, recomputing all "
+			     << nblocks << " blocks\n";
+			return checksum_rebuild();
+		}
+
+		vector<char> buffer(blocksize);
+		int recomputed = 0;
+		for(int page = 0; page < npages; page++) {
+			if(!log[page])
+				continue;
+
+			int first = page * CHECKSUMS_PER_PAGE;
+			int last = min(first + (int) CHECKSUMS_PER_PAGE, nblocks);
+			for(int i = first; i < last; i++) {
+				if(pread(imgfd, buffer.data(), blocksize, (off_t) i * blocksize) != blocksize) {
+					checksums.clear();
+					checksum_dirty.clear();
+					checksum_logged.clear();
+					return 0;
+				}
+				checksums[i] = CRC32C::compute(buffer.data(), blocksize);
+				recomputed++;
+			}
+			checksum_dirty[page] = true;
+			checksum_logged[page] = 1;
+		}
+
+		cout << "checksums were not saved on last close, recomputed " << recomputed << " of " << nblocks
+		     << " blocks (pages being written)\n";
+	}
+
+	checksum_flush(false);
+	return 1;
+}
+
+// Posição do registro de páginas marcadas, depois dos checksums
+off_t Disk::checksum_log_offset()
+{
+	return (off_t) nblocks * blocksize + sizeof(checksum_header) + (off_t) nblocks * sizeof(unsigned int);
+}
+
+// Marca no registro a página de checksums do bloco antes de ele mudar no disco
+void Disk::checksum_mark(int blocknum)
+{
+	int page = blocknum / CHECKSUMS_PER_PAGE;
+	if(checksum_logged[page])
+		return;
+
+	char mark = 1;
+	if(pwrite(fileno(diskfile), &mark, 1, checksum_log_offset() + page) != 1) {
+		cout << "ERROR: couldn't write checksums\n";
+		abort();
+	}
+	checksum_logged[page] = 1;
+}
+
+void Disk::checksum_verify(int blocknum, const char *data)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	unsigned int crc = CRC32C::compute(data, blocksize);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	verify_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+	nverified++;
+
+	if(crc != checksums[blocknum]) {
+		// Os checksums em memória estão certos: grava como limpos para o erro não sumir na próxima abertura
+		checksum_flush(true);
+		cout << "ERROR: checksum mismatch on block " << blocknum << "!" << endl;
+		abort();
+	}
+}
+
+void Disk::checksum_update(int blocknum, const char *data)
+{
+	checksums[blocknum] = CRC32C::compute(data, blocksize);
+	checksum_dirty[blocknum / CHECKSUMS_PER_PAGE] = true;
+
+	if(++checksum_pending >= CHECKSUM_BATCH)
+		checksum_flush(false);
+}
+
+// Grava as páginas de checksums alteradas e o cabeçalho
+void Disk::checksum_flush(bool clean)
+{
+	int imgfd = fileno(diskfile);
+	off_t region = (off_t) nblocks * blocksize;
+
+	fflush(diskfile);
+
+	for(size_t page = 0; page < checksum_dirty.size(); page++) {
+		if(!checksum_dirty[page])
+			continue;
+
+		int first = page * CHECKSUMS_PER_PAGE;
+		int count = min((int) CHECKSUMS_PER_PAGE, nblocks - first);
+		ssize_t bytes = (ssize_t) count * sizeof(unsigned int);
+		off_t offset = region + sizeof(checksum_header) + (off_t) first * sizeof(unsigned int);
+
+		if(pwrite(imgfd, &checksums[first], bytes, offset) != bytes) {
+			cout << "ERROR: couldn't write checksums\n";
+			abort();
+		}
+		checksum_dirty[page] = false;
+	}
+
+	// Com os blocos e as páginas gravados, nenhuma página fica desatualizada: limpa o registro
+	if(count(checksum_logged.begin(), checksum_logged.end(), 1) > 0) {
+		fill(checksum_logged.begin(), checksum_logged.end(), 0);
+		ssize_t bytes = checksum_logged.size();
+		if(pwrite(imgfd, checksum_logged.data(), bytes, checksum_log_offset()) != bytes) {
+			cout << "ERROR: couldn't write checksums\n";
+			abort();
+		}
+	}
+
+	checksum_header header;
+	header.magic = DISK_MAGIC;
+	header.nblocks = nblocks;
+	header.blocksize = blocksize;
+	header.clean = clean;
+
+	if(pwrite(imgfd, &header, sizeof(header), region) != sizeof(header)) {
+		cout << "ERROR: couldn't write checksums\n";
+		abort();
+	}
+
+	checksum_pending = 0;
+}
+
+void Disk::checksum_close()
+{
+	if(diskfile && !checksums.empty())
+		checksum_flush(true);
 }
 
 void Disk::close()
 {
 	if(diskfile) {
-		cout << nreads << " disk block reads\n";
-		cout << nwrites << " disk block writes\n";
+		checksum_close();
+		if(verbose) {
+			cout << nreads << " disk block reads\n";
+			cout << nwrites << " disk block writes\n";
+			if(nverified)
+				cout << nverified << " checksum verifications (" << verify_ns / 1000 << " us)\n";
+		}
 		fclose(diskfile);
 		diskfile = 0;
 	}
 }
 
+bool Disk::is_open()
+{
+	return diskfile != 0;
+}
+
+int Disk::read_count()
+{
+	return nreads;
+}
+
+int Disk::write_count()
+{
+	return nwrites;
+}
+
+long long Disk::verify_count()
+{
+	return nverified;
+}
+
+long long Disk::verify_time_ns()
+{
+	return verify_ns;
+}
+
+// Quem junta várias imagens (StripedDisk) mostra um total só, então as imagens fecham em silêncio
+void Disk::set_verbose(bool v)
+{
+	verbose = v;
+}
+
@@ -4,6 +4,8 @@
 #include <fstream>
 #include <iostream>
 #include <stdio.h>
+#include <sys/types.h>
+#include <vector>
 
 using namespace std;
 
@@ -13,21 +15,68 @@ public:
     static const unsigned short int DISK_BLOCK_SIZE = 4096;
     static const unsigned int DISK_MAGIC = 0xdeadbeef;
 
-    Disk(const char *filename, int nblocks);
+    Disk(const char *filename, int nblocks, int blocksize = DISK_BLOCK_SIZE);
+    virtual ~Disk();
 
-    int size();
-    void read(int blocknum, char * data);
-    void write(int blocknum, const char * data);
-    void close();
+    virtual int size();
+    virtual int block_size();
+    virtual void read(int blocknum, char * data);
+    virtual void write(int blocknum, const char * data);
+    virtual int  export_blocks(int blocknum, int length, int fd, off_t *fdoffset = NULL);
+    virtual int  import_blocks(int blocknum, int length, int fd, off_t *fdoffset = NULL);
+    virtual int  enable_checksums(bool enable);
+    virtual void close();
+    virtual bool is_open();
+
+    // Contadores mostrados em close
+    int read_count();
+    int write_count();
+    long long verify_count();
+    long long verify_time_ns();
+    void set_verbose(bool verbose);
+
+protected:
+    Disk();
 
-private:
     void sanity_check(int blocknum, const void *data);
 
+    int nblocks;
+    int blocksize;
+
+private:
+    // Cabeçalho da região de checksums, logo depois do último bloco da imagem
+    class checksum_header {
+        public:
+            unsigned int magic;
+            int nblocks;
+            int blocksize;
+            int clean; // 0 enquanto a imagem está aberta: checksums podem estar atrasados
+    };
+
+    static const int CHECKSUMS_PER_PAGE = 1024; // Checksums gravados juntos (4 KiB)
+    static const int CHECKSUM_BATCH = 64; // Escritas de blocos entre gravações dos checksums
+
+    void checksum_verify(int blocknum, const char *data);
+    void checksum_update(int blocknum, const char *data);
+    void checksum_mark(int blocknum);
+    off_t checksum_log_offset();
+    int checksum_load();
+    int checksum_rebuild();
+    void checksum_flush(bool clean);
+    void checksum_close();
+
 private:
     FILE *diskfile;
-    int nblocks;
+    bool verbose; // Se close mostra os contadores
     int nreads;
     int nwrites;
+
+    std::vector<unsigned int> checksums; // CRC32C de cada bloco (vazio = desligado)
+    std::vector<bool> checksum_dirty; // Páginas de checksums ainda não gravadas
+    std::vector<char> checksum_logged; // Páginas marcadas no registro em disco como possivelmente desatualizadas
+    int checksum_pending;
+    long long nverified;
+    long long verify_ns; // Tempo gasto verificando checksums
 };
 
 
@@ -1,6 +1,40 @@
 #include "fs.h"
+#include "compress.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Cria o sistema de arquivos especializado para o tamanho de bloco do disco (0 se não é suportado)
+INE5412_FS *INE5412_FS::create(Disk *d) {
+    switch (d->block_size()) {
+        case 1024:  return new INE5412_FS_Impl<1024>(d);
+        case 2048:  return new INE5412_FS_Impl<2048>(d);
+        case 4096:  return new INE5412_FS_Impl<4096>(d);
+        case 8192:  return new INE5412_FS_Impl<8192>(d);
+        case 16384: return new INE5412_FS_Impl<16384>(d);
+        case 32768: return new INE5412_FS_Impl<32768>(d);
+        case 65536: return new INE5412_FS_Impl<65536>(d);
+    }
+    return 0;
+}
+
+// Lê do superbloco da imagem o tamanho de bloco com que ela foi formatada (0 se não há sistema de arquivos válido)
+int INE5412_FS::probe_block_size(const char *filename) {
+    fs_superblock super;
+
+    FILE *file = fopen(filename, "r");
+    if (!file) return 0;
+
+    int result = fread(&super, sizeof(super), 1, file);
+    fclose(file);
+
+    if (result != 1 || super.magic != FS_MAGIC) {
+        return 0;
+    }
+    return super.block_size ? super.block_size : Disk::DISK_BLOCK_SIZE;
+}
 
-int INE5412_FS::fs_format() {
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_format(bool lazy) {
     if (is_mounted) return 0;
 
     int nblocks = disk->size();
@@ -16,13 +50,14 @@ int INE5412_FS::fs_format() {
     union fs_block block;
 
     // Como todos os inode_blocks iniciam inválidos, só configura uma vez
-    for (int i = 0; i < INODES_PER_BLOCK; i++) {
-        block.inode[i].isvalid = 0;
-    }
+    memset(block.data, 0, BLOCK_SIZE);
 
-    // Escreve o bloco de inodos configurado em todos os inode_blocks
-    for (int i = 0; i < ninodeblocks; i++) {
-        disk->write(i+1, block.data);
+    // Escreve o bloco de inodos configurado em todos os inode_blocks. No modo preguiçoso nenhum é escrito
+    // agora: os blocos a partir de inode_hwm são tratados como vazios e inicializados só quando forem usados
+    if (not lazy) {
+        for (int i = 0; i < ninodeblocks; i++) {
+            disk->write(i+1, block.data);
+        }
     }
 
     int ninodes = ninodeblocks * INODES_PER_BLOCK;
@@ -31,13 +66,21 @@ int INE5412_FS::fs_format() {
     block.super.nblocks = nblocks;
     block.super.ninodeblocks = ninodeblocks;
     block.super.ninodes = ninodes;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        block.super.snapshots[i] = 0;
+    }
+    block.super.features = lazy ? FS_FEATURE_LAZY_INODES : 0;
+    block.super.inode_hwm = 0;
+    block.super.block_size = BLOCK_SIZE;
+    block.super.root = 0; // Criado no primeiro uso de um caminho
 
     disk->write(0, block.data);
 
     return 1;
 }
 
-void INE5412_FS::fs_debug() {
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::fs_debug() {
     union fs_block block;
 
     if (not is_mounted) return;
@@ -47,11 +90,36 @@ void INE5412_FS::fs_debug() {
     cout << "superblock:\n";
     cout << "    " << (block.super.magic == FS_MAGIC ? "magic number is valid\n" : "magic number is invalid!\n");
     cout << "    " << block.super.nblocks << " blocks\n";
+    cout << "    " << BLOCK_SIZE << " bytes per block\n";
     cout << "    " << block.super.ninodeblocks << " inode blocks\n";
     cout << "    " << block.super.ninodes << " inodes\n";
 
-    for (int i = 0; i < block.super.ninodeblocks + 1; i++) {
-        disk->read(i + 1, block.data);
+    if (inode_hwm < block.super.ninodeblocks) {
+        cout << "    " << inode_hwm << " inode blocks initialized\n";
+    }
+    if (block.super.features & FS_FEATURE_DEDUP) {
+        cout << "    " << "deduplication enabled\n";
+    }
+    if (mounted_snapshot >= 0) {
+        cout << "    " << "mounted read-only from snapshot " << mounted_snapshot << "\n";
+    }
+
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        std::vector<int> copies, descriptors;
+        if (snapshot_load(block, i, copies, descriptors) != 0) {
+            cout << "snapshot " << i << ":\n";
+            cout << "    " << "descriptor blocks: ";
+            for (size_t k = 0; k < descriptors.size(); k++) {
+                cout << descriptors[k] << " ";
+            }
+            cout << endl;
+        }
+    }
+
+    int ninodeblocks = block.super.ninodeblocks;
+
+    for (int i = 0; i < ninodeblocks; i++) {
+        inode_block_read(i, block);
 
         for (int j = 0; j < INODES_PER_BLOCK; j++) {
             fs_inode inode = block.inode[j];
@@ -59,6 +127,12 @@ void INE5412_FS::fs_debug() {
             if (inode.isvalid) {
                 cout << "inode " << i * INODES_PER_BLOCK + j + 1 << ":" << endl;
                 cout << "    " << "size: " << inode.size << " bytes" << endl;
+                if (inode.isvalid & INODE_COMPRESSED) {
+                    cout << "    " << "compressed" << endl;
+                }
+                if (inode.isvalid & INODE_DIRECTORY) {
+                    cout << "    " << "directory" << (i * INODES_PER_BLOCK + j + 1 == root ? " (root)" : "") << endl;
+                }
                 if (inode.size > 0) {
                     cout << "    " << "direct blocks: ";
                     for (int k = 0; k < POINTERS_PER_INODE; k++) {
@@ -94,87 +168,266 @@ void INE5412_FS::fs_debug() {
     }
 }
 
-int INE5412_FS::fs_mount() {
-    union fs_block block;
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_mount(int snapshot) {
+    union fs_block super, block;
+    std::vector<int> copies, descriptors;
 
     if (is_mounted) {
         return 0;
     }
 
-    disk->read(0, block.data);
+    disk->read(0, super.data);
     
-    // Sistema de arquivos presente é inválido
-    if (block.super.magic != FS_MAGIC) {
+    // Sistema de arquivos presente é inválido ou foi formatado com outro tamanho de bloco
+    if (super.super.magic != FS_MAGIC) {
+        return 0;
+    }
+    if ((super.super.block_size ? super.super.block_size : Disk::DISK_BLOCK_SIZE) != BLOCK_SIZE) {
         return 0;
     }
 
-    // Inicia considerando todos livres  
-    for (int i = 0; i < block.super.nblocks; i++) {
-        bitmap.push_back(0);
+    // Snapshot pedido não existe
+    if (snapshot >= 0 && (snapshot >= MAX_SNAPSHOTS || snapshot_load(super, snapshot, copies, descriptors) == 0)) {
+        return 0;
     }
 
-    bitmap[0] = 1;
+    // Inicia considerando todos livres. Cada posição guarda quantas referências o bloco tem,
+    // já que com deduplicação e snapshots um mesmo bloco pode ser apontado por mais de um inodo
+    bitmap.assign(super.super.nblocks, 0);
 
-    int ninodeblocks = block.super.ninodeblocks;
+    bitmap[0] = 1;
 
+    int ninodeblocks = super.super.ninodeblocks;
+    inode_hwm = inode_blocks_initialized(super);
 
     for (int i = 0; i < ninodeblocks; i++) {
-        disk->read(i+1, block.data);
         bitmap[i+1] = 1; // Blocos de inodo são sempre ocupados
 
+        // Blocos ainda não inicializados não têm inodos válidos, nem precisam ser lidos
+        if (i >= inode_hwm) continue;
+        disk->read(i+1, block.data);
+
         for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            fs_inode inode = block.inode[j];
+            if (block.inode[j].isvalid) inode_count(&block.inode[j]);
+        }
+    }
 
-            if (inode.isvalid) {
-                // Verifica blocos diretos
-                for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                    if (inode.direct[k] != 0) bitmap[inode.direct[k]] = 1;
-                }
+    // Os snapshots também referenciam blocos: os descritores, as cópias dos blocos de inodos e os blocos dos seus inodos
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        if (snapshot_load(super, s, copies, descriptors) == 0) continue;
+
+        for (size_t k = 0; k < descriptors.size(); k++) {
+            bitmap[descriptors[k]] = 1;
+        }
 
-                // Verifica bloco indireto e blocos de dados associados
-                if (inode.indirect != 0) {
-                    bitmap[inode.indirect] = 1;
+        for (int i = 0; i < ninodeblocks; i++) {
+            if (copies[i] == 0) continue;
 
-                    union fs_block indirect;
-                    disk->read(inode.indirect, indirect.data);
+            disk->read(copies[i], block.data);
+            bitmap[copies[i]] = 1;
 
-                    for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        if (indirect.pointers[k] != 0) {
-                            bitmap[indirect.pointers[k]] = 1;
-                        }
-                    }
-                }
+            for (int j = 0; j < INODES_PER_BLOCK; j++) {
+                if (block.inode[j].isvalid) inode_count(&block.inode[j]);
             }
         }
     }
 
+    // Montando um snapshot, os inodos passam a ser lidos das cópias (somente leitura)
+    mounted_snapshot = snapshot;
+    snapshot_blocks.clear();
+    root = (super.super.features & FS_FEATURE_DIRECTORIES) ? super.super.root : 0;
+    dentry_cache.clear();
+    inode_free_hint = 0;
+    if (snapshot >= 0) {
+        snapshot_load(super, snapshot, copies, descriptors);
+        snapshot_blocks = copies;
+    }
+
     is_mounted = true;
 
+    // Deduplicação ligada numa montagem anterior: refaz o índice, que não é gravado no disco
+    if (snapshot < 0 && (super.super.features & FS_FEATURE_DEDUP)) {
+        fs_dedup(true);
+    }
+
+    return 1;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_unmount() {
+
+    if (not is_mounted) return 0;
+
+    bitmap.clear();
+    dedup = false;
+    dedup_index.clear();
+    dedup_hash.clear();
+    mounted_snapshot = -1;
+    snapshot_blocks.clear();
+    inode_hwm = 0;
+    root = 0;
+    dentry_cache.clear();
+
+    is_mounted = false;
+
     return 1;
 }
 
-int INE5412_FS::fs_create() {
+// Tira um snapshot: guarda uma cópia dos blocos de inodos (só dos que têm algum inodo válido) e passa a
+// contar mais uma referência a cada bloco apontado por eles. Daí em diante, escrever num bloco compartilhado
+// aloca um bloco novo (copy-on-write), então o snapshot continua vendo o conteúdo do momento em que foi tirado.
+// Retorna o número do snapshot ou -1 se não foi possível.
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_snapshot_create() {
+    union fs_block block;
+
+    if (not is_mounted || mounted_snapshot >= 0) return -1;
+
+    disk->read(0, block.data);
+
+    int ninodeblocks = block.super.ninodeblocks;
+
+    std::vector<int> copies, descriptors;
+    int slot = -1;
+    for (int s = 0; s < MAX_SNAPSHOTS && slot < 0; s++) {
+        if (snapshot_load(block, s, copies, descriptors) == 0) slot = s;
+    }
+    if (slot < 0) return -1;
+
+    // Tabela de inodos grande demais para um descritor continua em outros, encadeados por next
+    int ndescriptors = (ninodeblocks + SNAPSHOT_INODE_BLOCKS - 1) / SNAPSHOT_INODE_BLOCKS;
+
+    // Verifica antes se há espaço para os descritores e todas as cópias
+    std::vector<bool> used(ninodeblocks, false);
+    int needed = ndescriptors;
+    for (int i = 0; i < ninodeblocks; i++) {
+        inode_block_read(i, block);
+        for (int j = 0; j < INODES_PER_BLOCK && not used[i]; j++) {
+            if (block.inode[j].isvalid) used[i] = true;
+        }
+        if (used[i]) needed++;
+    }
+
+    int free_blocks = 0;
+    for (size_t b = 1; b < bitmap.size(); b++) {
+        if (bitmap[b] == 0) free_blocks++;
+    }
+    if (free_blocks < needed) return -1;
+
+    copies.assign(ninodeblocks, 0);
+
+    for (int i = 0; i < ninodeblocks; i++) {
+        if (not used[i]) continue;
+
+        inode_block_read(i, block);
+
+        int copy = next_free_block();
+        disk->write(copy, block.data);
+        copies[i] = copy;
+
+        // Os blocos de dados sob um indireto são contados uma vez só, pelo próprio indireto
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            fs_inode inode = block.inode[j];
+            if (not inode.isvalid) continue;
+
+            for (int k = 0; k < POINTERS_PER_INODE; k++) {
+                if (inode.direct[k] != 0) bitmap[inode.direct[k]]++;
+            }
+            if (inode.indirect != 0) bitmap[inode.indirect]++;
+        }
+    }
+
+    descriptors.clear();
+    for (int d = 0; d < ndescriptors; d++) {
+        descriptors.push_back(next_free_block());
+    }
+
+    union fs_block desc;
+    memset(desc.data, 0, BLOCK_SIZE);
+    desc.snapshot.magic = FS_SNAPSHOT_MAGIC;
+    desc.snapshot.ninodeblocks = ninodeblocks;
+
+    for (int d = 0; d < ndescriptors; d++) {
+        int first = d * SNAPSHOT_INODE_BLOCKS;
+        int count = std::min(SNAPSHOT_INODE_BLOCKS, ninodeblocks - first);
+
+        memset(desc.snapshot.inode_blocks, 0, sizeof(desc.snapshot.inode_blocks));
+        memcpy(desc.snapshot.inode_blocks, copies.data() + first, count * sizeof(int));
+        desc.snapshot.next = d + 1 < ndescriptors ? descriptors[d + 1] : 0;
+        disk->write(descriptors[d], desc.data);
+    }
+
+    // O snapshot só passa a existir quando o superbloco aponta para a cadeia já gravada
+    disk->read(0, block.data);
+    block.super.snapshots[slot] = descriptors[0];
+    disk->write(0, block.data);
+
+    return slot;
+}
+
+// Apaga o snapshot, soltando as referências dos seus inodos e liberando o descritor e as cópias
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_snapshot_delete(int snapshot) {
+    union fs_block block;
+
+    if (not is_mounted || mounted_snapshot >= 0) return 0;
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS) return 0;
+
+    disk->read(0, block.data);
+
+    std::vector<int> copies, descriptors;
+    if (snapshot_load(block, snapshot, copies, descriptors) == 0) return 0;
+
+    for (size_t i = 0; i < copies.size(); i++) {
+        int copy = copies[i];
+        if (copy == 0) continue;
+
+        disk->read(copy, block.data);
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            if (block.inode[j].isvalid) inode_release(&block.inode[j]);
+        }
+        block_release(copy);
+    }
+    for (size_t k = 0; k < descriptors.size(); k++) {
+        block_release(descriptors[k]);
+    }
+
+    disk->read(0, block.data);
+    block.super.snapshots[snapshot] = 0;
+    disk->write(0, block.data);
+
+    return 1;
+}
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_create(bool compressed) {
     union fs_block block;
 
-	if (not is_mounted) return 0;
+	if (not is_mounted || mounted_snapshot >= 0) return 0;
 
     disk->read(0, block.data);
 
     int ninodeblocks = block.super.ninodeblocks;
 
-    // Busca primeiro inodo disponível
-    for (int inode_block = 0; inode_block < ninodeblocks; inode_block++) {
-        disk->read(inode_block + 1, block.data);
+    // Busca primeiro inodo disponível (os blocos antes de inode_free_hint estão cheios)
+    for (int inode_block = inode_free_hint; inode_block < ninodeblocks; inode_block++) {
+        inode_block_read(inode_block, block);
         for (int inode = 0; inode < INODES_PER_BLOCK; inode++) {
             // Encontrou inodo, configura para o estado inicial (comprimento 0 e ponteiros zerados)
             if (not block.inode[inode].isvalid) {
-                block.inode[inode].isvalid = 1;
+                block.inode[inode].isvalid = compressed ? 1 | INODE_COMPRESSED : 1;
                 block.inode[inode].size = 0;
                 for (int drct_point = 0; drct_point < POINTERS_PER_INODE; drct_point++) {
                     block.inode[inode].direct[drct_point] = 0;
                 }
                 block.inode[inode].indirect = 0;
                 disk->write(inode_block + 1, block.data);
+
+                // Primeiro uso de um bloco ainda não inicializado: ele acabou de ser gravado inteiro
+                if (inode_block >= inode_hwm) {
+                    inode_hwm_advance(inode_block + 1);
+                }
+                inode_free_hint = inode_block;
                 return inode_block * INODES_PER_BLOCK + inode + 1;
             }
         }
@@ -183,9 +436,10 @@ int INE5412_FS::fs_create() {
     return 0;
 }
 
-int INE5412_FS::fs_delete(int inumber) {
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_delete(int inumber) {
 
-	if (not is_mounted) return 0;
+	if (not is_mounted || mounted_snapshot >= 0) return 0;
 
     fs_inode inode;
     if (not inode_load(inumber, &inode)) {
@@ -195,33 +449,15 @@ int INE5412_FS::fs_delete(int inumber) {
 	if (not inode.isvalid)
 		return 0;
 
-    // Limpa do bitmap blocos diretos
-	for (int i = 0; i < POINTERS_PER_INODE; i++) {
-		if (inode.direct[i] != 0) {
-			bitmap[inode.direct[i]] = 0;
-		}
-	}
-    union fs_block block;
-
-    // Limpa do bitmap o bloco indireto e blocos de dados associados
-	if (inode.indirect != 0) {
-		disk->read(inode.indirect, block.data);
-
-		for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
-			if (block.pointers[i] != 0) {
-				bitmap[block.pointers[i]] = 0;
-			}
-		}
-
-		bitmap[inode.indirect] = 0;
-	}
+    // Diretórios e arquivos com nome só saem por fs_unlink: apagá-los aqui deixaria a entrada no diretório
+    // pai (e no dentry_cache). fs_unlink também confere se o diretório está vazio
+    if (inode.isvalid & (INODE_DIRECTORY | INODE_NAMED))
+        return -1;
 
-	inode.isvalid = false;
-	inode_save(inumber, &inode);
-    return 1;
+    return inode_free(inumber);
 }
-
-int INE5412_FS::fs_getsize(int inumber) {
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_getsize(int inumber) {
 
     if (not is_mounted) return -1;
 
@@ -237,7 +473,8 @@ int INE5412_FS::fs_getsize(int inumber) {
     return -1;
 }
 
-int INE5412_FS::fs_read(int inumber, char *data, int length, int offset) {
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_read(int inumber, char *data, int length, int offset) {
     
     if (not is_mounted) return 0;
 
@@ -258,38 +495,34 @@ int INE5412_FS::fs_read(int inumber, char *data, int length, int offset) {
         return 0;
     }
 
-    int num_block = offset/Disk::DISK_BLOCK_SIZE; //Bloco inicial relativo ao inodo
-    int pos_in_block = offset % Disk::DISK_BLOCK_SIZE; //Posicao inicial no bloco inicial 
-
-    union fs_block block;
+    if (inode.isvalid & INODE_COMPRESSED) {
+        return compressed_read(&inode, data, length, offset);
+    }
 
-    // Leitura inicial do bloco
-    inode_read_block(&inode, num_block, block);
+    // Não lê além do fim do arquivo
+    length = std::min(length, inode.size - offset);
 
-    // Escrita sequencial do inodo no char*data recebido
-    for (int i = 0; i < length; i++) {
+    union fs_block block;
+    int done = 0;
 
-        // Se durante a leitura de um bloco, chegar no fim do arquivo, volta a quantidade lida até o momento
-        if (offset + i + 1>= inode.size) {
-            return i + 1;
-        }
+    // Copia um bloco (ou o pedaço dele que interessa) de cada vez
+    while (done < length) {
+        int num_block = (offset + done) / BLOCK_SIZE; //Bloco atual relativo ao inodo
+        int pos_in_block = (offset + done) % BLOCK_SIZE; //Posicao inicial no bloco atual
+        int count = std::min(BLOCK_SIZE - pos_in_block, length - done);
 
-        // Se chegou no fim do bloco, lê o próximo a partir da posição inicial
-        if (pos_in_block == Disk::DISK_BLOCK_SIZE) {
-            num_block++;
-            inode_read_block(&inode, num_block, block);
-            pos_in_block = 0;
-        }
-        data[i] = block.data[pos_in_block];
-        pos_in_block++;
+        inode_read_block(&inode, num_block, block);
+        memcpy(data + done, block.data + pos_in_block, count);
+        done += count;
     }
 
-    return length;
+    return done;
 }
 
-int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset) {
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_write(int inumber, const char *data, int length, int offset) {
     
-    if (not is_mounted) return 0;
+    if (not is_mounted || mounted_snapshot >= 0) return 0;
 
     fs_inode inode;
     
@@ -298,14 +531,20 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
         return 0;
     }
 
-    // Se o inode não é válido, não há arquivo a ser lido
-    if (not inode.isvalid) {
+    // Se o inode não é válido, não há arquivo a ser lido. Diretórios só mudam pelas operações de diretório
+    if (not inode.isvalid || (inode.isvalid & INODE_DIRECTORY)) {
         return 0;
     }
 
+    if (inode.isvalid & INODE_COMPRESSED) {
+        int result = compressed_write(inumber, &inode, data, length, offset);
+        inode_save(inumber, &inode);
+        return result;
+    }
+
     // Pega a última posição do bloco anterior
-    int num_block = offset/Disk::DISK_BLOCK_SIZE - 1;
-    int pos_in_block = Disk::DISK_BLOCK_SIZE;
+    int num_block = offset/BLOCK_SIZE - 1;
+    int pos_in_block = BLOCK_SIZE;
 
     // Em transition será tualizado para o bloco inicial e verificará a necessidade de alocação
     // Se não conseguiu alocar, nem começa copiar
@@ -313,7 +552,7 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
         return 0;
     }
 
-    pos_in_block = offset % Disk::DISK_BLOCK_SIZE; //Atualiza a posição inicial
+    pos_in_block = offset % BLOCK_SIZE; //Atualiza a posição inicial
 
     union fs_block block;
 
@@ -322,23 +561,34 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
 
     int i;
     int temp = num_block;
+    bool pending = false; // Se o bloco atual tem dados ainda não gravados
 
     for (i = 0; i < length; i++) {
         block.data[pos_in_block] = data[i]; // Atualiza o valor no bloco de dados
         temp = num_block; // Salva o antigo num do bloco relativo ao inodo
+        pending = true;
 
         // Se não conseguiu alocar um novo bloco, para de copiar
         if (not transition(&inode, num_block, pos_in_block)) {
             i++;
-            block.data[pos_in_block] = data[i];
-            inode_write_block(&inode, temp, block);
             break;
         };
         if (num_block != temp) {
-            inode_write_block(&inode, temp, block);
+            pending = false;
+            // Se não conseguiu gravar o bloco (sem espaço para a cópia de um bloco compartilhado), descarta o que foi escrito nele
+            if (not inode_write_block(&inode, temp, block)) {
+                i = std::max(0, temp * BLOCK_SIZE - offset);
+                break;
+            }
             inode_read_block(&inode, num_block, block);
         }
     }
+
+    // Grava o último bloco, parcialmente preenchido
+    if (pending && not inode_write_block(&inode, temp, block)) {
+        i = std::max(0, temp * BLOCK_SIZE - offset);
+    }
+
     if (offset + i > inode.size) {
         inode.size = offset + i;
     }
@@ -346,108 +596,585 @@ int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
     return i;
 }
 
-// Busca o próximo bloco livre a partir do bitmap (retorna o número do bloco no disco ou 0 se não houver)
-int INE5412_FS::next_free_block() {
-    for (size_t num_block = 1; num_block < bitmap.size(); num_block++) {
-        if (bitmap[num_block] == 0) {
-            bitmap[num_block] = 1;
-            return num_block;
+// Copia o conteúdo do inodo direto para o descritor fd, transferindo cada sequência de blocos
+// contíguos no disco de uma só vez (retorna a quantidade de bytes copiados ou -1 em caso de erro)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_export(int inumber, int fd) {
+
+    if (not is_mounted) return -1;
+
+    fs_inode inode;
+    if (not inode_load(inumber, &inode) or not inode.isvalid) {
+        return -1;
+    }
+
+    // Arquivo comprimido precisa ser descomprimido, então copia com buffer
+    if (inode.isvalid & INODE_COMPRESSED) {
+        char buffer[4 * BLOCK_SIZE];
+        int copied = 0;
+
+        while (copied < inode.size) {
+            int result = compressed_read(&inode, buffer, sizeof(buffer), copied);
+            if (result <= 0) break;
+            if (write(fd, buffer, result) != result) break;
+            copied += result;
         }
+        return copied;
     }
-    return 0;
+
+    int max_size = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * BLOCK_SIZE;
+    int size = std::min(inode.size, max_size);
+
+    int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<int> blocks;
+    inode_block_list(&inode, nblocks, blocks);
+
+    int copied = 0;
+
+    for (int start = 0; start < nblocks;) {
+        // Estende a sequência enquanto os blocos físicos forem consecutivos
+        int end = start + 1;
+        while (end < nblocks && blocks[start] != 0 && blocks[end] == blocks[end - 1] + 1) {
+            end++;
+        }
+
+        int length = std::min(end * BLOCK_SIZE, size) - start * BLOCK_SIZE;
+        int result;
+
+        // Bloco nunca escrito (buraco no arquivo) é lido como zeros
+        if (blocks[start] == 0) {
+            char zeros[BLOCK_SIZE] = {0};
+            result = write(fd, zeros, length);
+        } else {
+            result = disk->export_blocks(blocks[start], length, fd);
+        }
+
+        if (result > 0) copied += result;
+        if (result != length) break;
+
+        start = end;
+    }
+
+    return copied;
 }
 
-// Carrega o inodo do inumber referente
-int INE5412_FS::inode_load(int inumber, fs_inode *inode) {
+// Preenche o inodo com o conteúdo lido de fd a partir do início, alocando os blocos antes e
+// transferindo cada sequência contígua direto para o disco (retorna os bytes copiados ou -1)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_import(int inumber, int fd) {
 
-    union fs_block block;
+    if (not is_mounted || mounted_snapshot >= 0) return -1;
 
-    inumber--; // Ajuste visto que inumber 0 não é válido ao usuário, mas pro disco sim
+    fs_inode inode;
+    if (not inode_load(inumber, &inode) or not inode.isvalid or (inode.isvalid & INODE_DIRECTORY)) {
+        return -1;
+    }
 
-    disk->read(0, block.data);
-    if (inumber < 0 || block.super.ninodes < inumber) {
-        return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
     }
 
-    // Pega o bloco no disco referente ao inumber (+ 1 porque 0 é o superbloco)
-    int inode_block = inumber / INODES_PER_BLOCK + 1;
+    // Limita ao tamanho máximo de um arquivo
+    int max_size = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * BLOCK_SIZE;
 
-    // Lê o inode block e pega o inode relativo ao bloco
-    disk->read(inode_block, block.data);
-    *inode = block.inode[inumber % INODES_PER_BLOCK];
-    return 1;
-}
+    // Pipe, FIFO ou socket não têm tamanho conhecido (st_size é 0): lê até o fim.
+    // Arquivo comprimido ou deduplicação ligada: cada bloco precisa passar por fs_write
+    if (not S_ISREG(st.st_mode) or dedup or (inode.isvalid & INODE_COMPRESSED)) {
+        return import_buffered(inumber, fd, S_ISREG(st.st_mode) ? std::min((off_t) max_size, st.st_size) : max_size);
+    }
 
-// Salva o inodo no inumber referente
-int INE5412_FS::inode_save(int inumber, fs_inode *inode) {
+    int size = st.st_size < max_size ? st.st_size : max_size;
 
-    union fs_block block;
+    int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<int> before;
+    inode_block_list(&inode, POINTERS_PER_INODE + POINTERS_PER_BLOCK, before);
 
-    inumber--; // Ajuste visto que inumber 0 não é válido ao usuário, mas pro disco sim
+    // Blocos compartilhados (inclusive via um bloco indireto compartilhado) precisam de copy-on-write,
+    // que só acontece passando por fs_write. Decide antes de reservar: a reserva poderia tomar os blocos
+    // livres de que as cópias precisam
+    bool shared = nblocks > POINTERS_PER_INODE && inode.indirect != 0 && bitmap[inode.indirect] > 1;
+    for (int k = 0; k < nblocks && not shared; k++) {
+        shared = before[k] != 0 && bitmap[before[k]] > 1;
+    }
+    if (shared) {
+        return import_buffered(inumber, fd, size);
+    }
 
-    disk->read(0, block.data);
-    if (inumber < 0 || block.super.ninodes < inumber) {
-        return 0;
+    // Aloca de uma vez todos os blocos necessários; se o disco encher, copia o que couber
+    nblocks = inode_reserve(&inode, nblocks);
+    size = std::min(size, nblocks * BLOCK_SIZE);
+
+    std::vector<int> blocks;
+    inode_block_list(&inode, nblocks, blocks);
+
+    int copied = 0;
+
+    for (int start = 0; start < nblocks;) {
+        int end = start + 1;
+        while (end < nblocks && blocks[end] == blocks[end - 1] + 1) {
+            end++;
+        }
+
+        int length = std::min(end * BLOCK_SIZE, size) - start * BLOCK_SIZE;
+        int result = disk->import_blocks(blocks[start], length, fd);
+
+        if (result > 0) copied += result;
+        if (result != length) break;
+
+        start = end;
     }
 
-    // Pega o bloco no disco referente ao inumber (+ 1 porque 0 é o superbloco)
-    int inode_block = inumber / INODES_PER_BLOCK + 1;
+    if (copied > inode.size) {
+        inode.size = copied;
+    }
 
-    // Lê o inode block e pega o inode relativo ao bloco
-    disk->read(inode_block, block.data);
-    block.inode[inumber % INODES_PER_BLOCK] = *inode;
-    disk->write(inode_block, block.data);
-    return 1;
+    // fd pode ter terminado antes do tamanho visto por fstat: solta o que foi reservado e não usado
+    inode_trim(&inode, (copied + BLOCK_SIZE - 1) / BLOCK_SIZE, before);
+    inode_save(inumber, &inode);
+    return copied;
 }
 
-// Escrita de um bloco relativo (pont) ao inode
-void INE5412_FS::inode_write_block(fs_inode *inode, int &pont, union fs_block &block) {
-    union fs_block block2;
+// Mede a fragmentação: quantas sequências contíguas cada arquivo ocupa e em quantos trechos está o espaço livre
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_fragmentation(fs_frag_report *report) {
 
-    // Verifica se é relativo a um indireto, se não é um dos bloco direto
-    if (pont >= POINTERS_PER_INODE) {
-        disk->read(inode->indirect, block2.data);
-        disk->write(block2.pointers[pont-POINTERS_PER_INODE], block.data);
-    } else {
-        disk->write(inode->direct[pont], block.data);
+    if (not is_mounted) return 0;
+
+    std::vector<int> inumbers, ponts, blocks;
+    layout_order(inumbers, ponts, blocks);
+
+    report->files = 0;
+    report->blocks = blocks.size();
+    report->extents = 0;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (i == 0 || inumbers[i] != inumbers[i - 1]) {
+            report->files++;
+            report->extents++;
+        } else if (blocks[i] != blocks[i - 1] + 1) {
+            report->extents++;
+        }
     }
-}
 
-// Leitura de um bloco relativo (pont) ao inode
-void INE5412_FS::inode_read_block(fs_inode *inode, int &pont, union fs_block &block) {
-    union fs_block block2;
+    union fs_block block;
+    disk->read(0, block.data);
 
-    // Verifica se é relativo a um indireto, se não é um dos bloco direto
-    if (pont >= POINTERS_PER_INODE) {
-        disk->read(inode->indirect, block2.data);
-        disk->read(block2.pointers[pont-POINTERS_PER_INODE], block.data);
-    } else {
-        disk->read(inode->direct[pont], block.data);
+    report->free_blocks = 0;
+    report->free_extents = 0;
+
+    for (size_t i = block.super.ninodeblocks + 1; i < bitmap.size(); i++) {
+        if (bitmap[i] == 0) {
+            report->free_blocks++;
+            if (bitmap[i - 1] != 0) report->free_extents++;
+        }
     }
+
+    return 1;
 }
 
-// Atualiza a posição no bloco a ser lido e verifica necessidade de alocação
-int INE5412_FS::transition(fs_inode *inode, int &pont, int &block_pos) {
-    block_pos++;
+// Desfragmenta com o sistema montado: os blocos de cada arquivo são movidos, na ordem dos inodos,
+// para uma sequência contígua logo após os blocos de inodo, o que também junta todo o espaço livre no fim.
+// max_moves limita quantos blocos são movidos por chamada (0 = sem limite), permitindo fazer aos poucos;
+// uma chamada limitada nunca aumenta a quantidade de extents. Uma troca de lugar conta como três movimentos.
+// Retorna a quantidade de blocos movidos ou -1 em caso de erro.
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_defrag(int max_moves) {
+
+    if (not is_mounted || mounted_snapshot >= 0) return -1;
+
+    std::vector<int> inumbers, ponts, blocks;
+    layout_order(inumbers, ponts, blocks);
+    int n = blocks.size();
+
+    // Dono de cada bloco do disco (índice na ordem desejada, -1 se não pertence a nenhum arquivo ou é compartilhado)
+    std::vector<int> owner(bitmap.size(), -1);
+    bool shared_indirect = false;
+    for (int i = 0; i < n; i++) {
+        // Blocos sob um indireto compartilhado também são compartilhados
+        if (ponts[i] < 0) shared_indirect = bitmap[blocks[i]] > 1;
+        if (bitmap[blocks[i]] == 1 && not (ponts[i] >= POINTERS_PER_INODE && shared_indirect)) owner[blocks[i]] = i;
+    }
+
     union fs_block block;
-    int next_block;
+    disk->read(0, block.data);
 
-    if (block_pos >= Disk::DISK_BLOCK_SIZE) {
-        pont++;
-        block_pos = 0;
-    
-        //Verifica se excedeu os ponteiros diretos
-        if (pont >= POINTERS_PER_INODE) {
+    // Planeja tudo em memória antes de tocar no disco. Cada passo põe a entrada i no cursor; se o cursor está
+    // ocupado por um bloco que ainda vai ser posicionado, esse bloco troca de lugar com i
+    std::vector<int> position(blocks), used(bitmap);
+    std::vector<int> plan_entry, plan_victim, plan_to, plan_extents;
 
-            // Aloca um bloco para ponteiros indiretos se não tiver
-            if (inode->indirect == 0) {
-                next_block = next_free_block();
-                // Se next_block = 0, significa que não tem bloco livre
-                if (next_block == 0) {
-                    return 0;
-                } else {
-                    inode->indirect = next_block;
-                    disk->read(inode->indirect, block.data);
+    int extents = 0;
+    for (int k = 0; k < n; k++) {
+        if (not layout_adjacent(inumbers, position, k)) extents++;
+    }
+    int initial_extents = extents;
+
+    int cursor = block.super.ninodeblocks + 1;
+
+    for (int i = 0; i < n; i++) {
+        // Blocos compartilhados (deduplicação ou snapshots) ficam onde estão
+        if (owner[position[i]] != i) continue;
+
+        // Pula blocos ocupados que não podem ser movidos (compartilhados ou sem dono)
+        while (used[cursor] != 0 && owner[cursor] < 0) {
+            cursor++;
+        }
+
+        if (position[i] == cursor) {
+            cursor++;
+            continue;
+        }
+
+        int victim = used[cursor] != 0 ? owner[cursor] : -1;
+        int from = position[i];
+
+        // Só as adjacências das entradas que mudam de lugar (e das seguintes a elas) podem mudar
+        // (o bloco deslocado ainda não foi posicionado, então vem depois de i na ordem)
+        int affected[4] = {i, i + 1, victim, victim + 1};
+        int naffected = victim >= 0 ? 4 : 2;
+        if (victim == i + 1) {
+            affected[2] = i + 2;
+            naffected = 3;
+        }
+        for (int a = 0; a < naffected; a++) {
+            extents -= not layout_adjacent(inumbers, position, affected[a]);
+        }
+
+        if (victim >= 0) {
+            position[victim] = from;
+            owner[from] = victim;
+        } else {
+            used[from] = 0;
+            owner[from] = -1;
+        }
+        position[i] = cursor;
+        owner[cursor] = i;
+        used[cursor] = 1;
+
+        for (int a = 0; a < naffected; a++) {
+            extents += not layout_adjacent(inumbers, position, affected[a]);
+        }
+
+        plan_entry.push_back(i);
+        plan_victim.push_back(victim);
+        plan_to.push_back(cursor);
+        plan_extents.push_back(extents);
+        cursor++;
+    }
+
+    // Com limite de movimentos, executa o maior começo do plano que cabe no limite e não deixa o disco
+    // com mais extents do que tinha (um arquivo deslocado pela metade ficaria partido em dois)
+    int steps = plan_entry.size();
+    if (max_moves > 0) {
+        int cost = 0;
+        steps = 0;
+        for (size_t k = 0; k < plan_entry.size(); k++) {
+            cost += plan_victim[k] >= 0 ? 3 : 1;
+            if (cost > max_moves) break;
+            if (plan_extents[k] <= initial_extents) steps = k + 1;
+        }
+    }
+
+    // Bloco livre usado para guardar o bloco deslocado durante uma troca, procurado do fim para o início.
+    // Depois de cada troca ele volta a ficar livre, então o cursor só anda quando o bloco é ocupado
+    int spare = bitmap.size() - 1;
+    int moves = 0;
+
+    for (int k = 0; k < steps; k++) {
+        int e = plan_entry[k];
+        int victim = plan_victim[k];
+        int from = blocks[e];
+
+        // Sempre copia antes de trocar o ponteiro e só então libera o bloco antigo, inclusive nas trocas
+        if (victim >= 0) {
+            while (spare > 0 && bitmap[spare] != 0) {
+                spare--;
+            }
+            if (spare == 0) break;
+
+            defrag_move(inumbers[victim], ponts[victim], blocks[victim], spare);
+            defrag_move(inumbers[e], ponts[e], from, plan_to[k]);
+            defrag_move(inumbers[victim], ponts[victim], spare, from);
+            blocks[victim] = from;
+            moves += 3;
+        } else {
+            defrag_move(inumbers[e], ponts[e], from, plan_to[k]);
+            moves++;
+        }
+        blocks[e] = plan_to[k];
+    }
+
+    return moves;
+}
+
+// Se a entrada k da ordem de layout_order continua no disco a sequência da entrada anterior do mesmo inodo
+template <int BLOCK_SIZE>
+bool INE5412_FS_Impl<BLOCK_SIZE>::layout_adjacent(std::vector<int> &inumbers, std::vector<int> &blocks, int k) {
+    return k > 0 && k < (int) blocks.size() && inumbers[k] == inumbers[k - 1] && blocks[k] == blocks[k - 1] + 1;
+}
+
+// Move um bloco de um inodo de from para to: copia, troca o ponteiro (pont = -1 é o bloco indireto) e libera from
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::defrag_move(int inumber, int pont, int from, int to) {
+    union fs_block block;
+
+    disk->read(from, block.data);
+    disk->write(to, block.data);
+
+    fs_inode inode;
+    inode_load(inumber, &inode);
+    if (pont < 0) {
+        inode.indirect = to;
+    } else {
+        inode_set_pointer(&inode, pont, to);
+    }
+    inode_save(inumber, &inode);
+
+    bitmap[to] = 1;
+    bitmap[from] = 0;
+    if (dedup and dedup_hash[from] != 0) {
+        dedup_insert(to, dedup_hash[from]);
+        dedup_erase(from);
+    }
+}
+
+// Cópia com buffer de fd para o inodo via fs_write, usada quando a transferência direta não é possível.
+// Lê até size bytes ou até o fim de fd, o que vier antes (leituras curtas de pipes são normais)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::import_buffered(int inumber, int fd, int size) {
+    char buffer[4 * BLOCK_SIZE];
+    int copied = 0;
+
+    while (copied < size) {
+        int result = read(fd, buffer, std::min((int) sizeof(buffer), size - copied));
+        if (result <= 0) break;
+
+        int actual = fs_write(inumber, buffer, result, copied);
+        if (actual > 0) copied += actual;
+        if (actual != result) break;
+    }
+
+    return copied;
+}
+
+// Liga ou desliga a deduplicação de blocos de dados; a escolha fica no superbloco e vale para as próximas montagens.
+// O índice (hash -> bloco) só existe em memória: ao ligar, e a cada montagem com a deduplicação ligada, ele é
+// refeito lendo e calculando o hash de todos os blocos de dados em uso, uma leitura por bloco
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_dedup(bool enable) {
+
+    if (not is_mounted) return 0;
+
+    // Montado de um snapshot nada é gravado, então não há o que mudar no superbloco
+    if (mounted_snapshot < 0) {
+        union fs_block super;
+        disk->read(0, super.data);
+        if (bool(super.super.features & FS_FEATURE_DEDUP) != enable) {
+            super.super.features ^= FS_FEATURE_DEDUP;
+            disk->write(0, super.data);
+        }
+    }
+
+    dedup = enable;
+    dedup_index.clear();
+    dedup_hash.assign(bitmap.size(), 0);
+
+    if (not enable) return 1;
+
+    std::vector<int> inumbers, ponts, blocks;
+    layout_order(inumbers, ponts, blocks);
+
+    union fs_block block;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (ponts[i] < 0 || dedup_hash[blocks[i]] != 0) continue;
+        disk->read(blocks[i], block.data);
+        dedup_insert(blocks[i], block_hash(block));
+    }
+
+    return 1;
+}
+
+// Inicializa (zera) até count blocos de inodos ainda não inicializados de um sistema formatado no modo
+// preguiçoso, podendo ser chamada aos poucos. Retorna quantos blocos ainda faltam ou -1 em caso de erro
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_init_inodes(int count) {
+    union fs_block block;
+
+    if (not is_mounted || mounted_snapshot >= 0) return -1;
+
+    disk->read(0, block.data);
+    int ninodeblocks = block.super.ninodeblocks;
+
+    memset(block.data, 0, BLOCK_SIZE);
+
+    int hwm = inode_hwm;
+    for (int i = 0; i < count && hwm < ninodeblocks; i++, hwm++) {
+        disk->write(hwm + 1, block.data);
+    }
+    if (hwm != inode_hwm) {
+        inode_hwm_advance(hwm);
+    }
+
+    return ninodeblocks - inode_hwm;
+}
+
+// Busca o próximo bloco livre a partir do bitmap (retorna o número do bloco no disco ou 0 se não houver)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::next_free_block() {
+    for (size_t num_block = 1; num_block < bitmap.size(); num_block++) {
+        if (bitmap[num_block] == 0) {
+            bitmap[num_block] = 1;
+            return num_block;
+        }
+    }
+    return 0;
+}
+
+// Carrega o inodo do inumber referente
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::inode_load(int inumber, fs_inode *inode) {
+
+    union fs_block block;
+
+    inumber--; // Ajuste visto que inumber 0 não é válido ao usuário, mas pro disco sim
+
+    disk->read(0, block.data);
+    if (inumber < 0 || block.super.ninodes < inumber) {
+        return 0;
+    }
+
+    // Lê o inode block (do disco ou da cópia do snapshot montado) e pega o inode relativo ao bloco
+    inode_block_read(inumber / INODES_PER_BLOCK, block);
+    *inode = block.inode[inumber % INODES_PER_BLOCK];
+    return 1;
+}
+
+// Salva o inodo no inumber referente
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::inode_save(int inumber, fs_inode *inode) {
+
+    union fs_block block;
+
+    inumber--; // Ajuste visto que inumber 0 não é válido ao usuário, mas pro disco sim
+
+    disk->read(0, block.data);
+    if (inumber < 0 || block.super.ninodes < inumber || mounted_snapshot >= 0) {
+        return 0;
+    }
+
+    // Pega o bloco no disco referente ao inumber (+ 1 porque 0 é o superbloco)
+    int inode_block = inumber / INODES_PER_BLOCK + 1;
+
+    // Lê o inode block e pega o inode relativo ao bloco
+    disk->read(inode_block, block.data);
+    block.inode[inumber % INODES_PER_BLOCK] = *inode;
+    disk->write(inode_block, block.data);
+    return 1;
+}
+
+// Escrita de um bloco relativo (pont) ao inode
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::inode_write_block(fs_inode *inode, int &pont, union fs_block &block) {
+    union fs_block block2;
+    int current;
+
+    // Verifica se é relativo a um indireto, se não é um dos bloco direto.
+    // Um indireto compartilhado torna compartilhados os blocos sob ele, então primeiro separa o indireto
+    if (pont >= POINTERS_PER_INODE) {
+        if (not indirect_private(inode)) {
+            return 0;
+        }
+        disk->read(inode->indirect, block2.data);
+        current = block2.pointers[pont-POINTERS_PER_INODE];
+    } else {
+        current = inode->direct[pont];
+    }
+
+    unsigned long long hash = 0;
+
+    // Com deduplicação, se já existe um bloco com o mesmo conteúdo, passa a apontar para ele
+    if (dedup) {
+        hash = block_hash(block);
+        int same = dedup_find(hash, block);
+        if (same != 0) {
+            if (same != current) {
+                bitmap[same]++;
+                inode_set_pointer(inode, pont, same);
+                block_release(current);
+            }
+            return 1;
+        }
+    }
+
+    // Bloco compartilhado com outro inodo: grava uma cópia em vez de sobrescrever (copy-on-write)
+    if (bitmap[current] > 1) {
+        int copy = next_free_block();
+        // Se copy = 0, significa que não tem bloco livre
+        if (copy == 0) {
+            return 0;
+        }
+        inode_set_pointer(inode, pont, copy);
+        block_release(current);
+        current = copy;
+    }
+
+    dedup_erase(current);
+    disk->write(current, block.data);
+    if (dedup) {
+        dedup_insert(current, hash);
+    }
+    return 1;
+}
+
+// Leitura de um bloco relativo (pont) ao inode
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_read_block(fs_inode *inode, int &pont, union fs_block &block) {
+    union fs_block block2;
+    int num = 0;
+
+    // Verifica se é relativo a um indireto, se não é um dos bloco direto
+    if (pont >= POINTERS_PER_INODE) {
+        if (inode->indirect != 0) {
+            disk->read(inode->indirect, block2.data);
+            num = block2.pointers[pont-POINTERS_PER_INODE];
+        }
+    } else {
+        num = inode->direct[pont];
+    }
+
+    // Bloco nunca escrito (buraco no arquivo) é lido como zeros
+    if (num == 0) {
+        memset(block.data, 0, BLOCK_SIZE);
+    } else {
+        disk->read(num, block.data);
+    }
+}
+
+// Atualiza a posição no bloco a ser lido e verifica necessidade de alocação
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::transition(fs_inode *inode, int &pont, int &block_pos) {
+    block_pos++;
+    union fs_block block;
+    int next_block;
+
+    if (block_pos >= BLOCK_SIZE) {
+        pont++;
+        block_pos = 0;
+    
+        //Verifica se excedeu os ponteiros diretos
+        if (pont >= POINTERS_PER_INODE) {
+
+            // Aloca um bloco para ponteiros indiretos se não tiver
+            if (inode->indirect == 0) {
+                next_block = next_free_block();
+                // Se next_block = 0, significa que não tem bloco livre
+                if (next_block == 0) {
+                    return 0;
+                } else {
+                    inode->indirect = next_block;
+                    disk->read(inode->indirect, block.data);
                     // Ajuste para corrigir ponteiros de dados indevidos
                     for (int pointer = 0; pointer < POINTERS_PER_BLOCK; pointer++) {
                         block.pointers[pointer] = 0;
@@ -460,6 +1187,10 @@ int INE5412_FS::transition(fs_inode *inode, int &pont, int &block_pos) {
 
             // Aloca um bloco de dados se não tiver
             if (block.pointers[pont - POINTERS_PER_INODE] == 0) {
+                // O bloco indireto vai mudar: se é compartilhado, passa a usar uma cópia própria
+                if (not indirect_private(inode)) {
+                    return 0;
+                }
                 next_block = next_free_block();
                 // Se next_block = 0, significa que não tem bloco livre
                 if (next_block == 0) {
@@ -483,4 +1214,1081 @@ int INE5412_FS::transition(fs_inode *inode, int &pont, int &block_pos) {
         }
     }
     return 1;
-}
\ No newline at end of file
+}
+
+// Garante que os nblocks primeiros blocos relativos ao inodo estejam alocados (retorna quantos conseguiu)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::inode_reserve(fs_inode *inode, int nblocks) {
+    std::vector<int> blocks;
+    inode_block_list(inode, nblocks, blocks);
+
+    for (int i = 0; i < nblocks; i++) {
+        if (blocks[i] != 0) continue;
+
+        // Posiciona no último byte do bloco anterior para que transition avance e aloque o bloco i
+        int pont = i - 1;
+        int block_pos = BLOCK_SIZE - 1;
+        if (not transition(inode, pont, block_pos)) {
+            return i;
+        }
+    }
+    return nblocks;
+}
+
+// Solta os blocos relativos ao inodo a partir de from, menos os que aparecem em keep (a lista de inode_block_list
+// de antes de um inode_reserve, para desfazer só a reserva; vazia para soltar tudo). O bloco indireto também é
+// solto se fica sem nenhum bloco
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_trim(fs_inode *inode, int from, std::vector<int> &keep) {
+    int nblocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    std::vector<int> blocks;
+    inode_block_list(inode, nblocks, blocks);
+
+    std::vector<bool> drop(nblocks, false);
+    int remaining = 0; // Blocos que continuam sob o indireto
+    int dropped = 0; // Blocos a soltar sob o indireto
+
+    for (int k = std::max(from, 0); k < nblocks; k++) {
+        drop[k] = blocks[k] != 0 && not ((size_t) k < keep.size() && keep[k] != 0);
+    }
+    for (int k = POINTERS_PER_INODE; k < nblocks; k++) {
+        if (drop[k]) dropped++;
+        else if (blocks[k] != 0) remaining++;
+    }
+
+    for (int k = 0; k < POINTERS_PER_INODE; k++) {
+        if (not drop[k]) continue;
+        block_release(blocks[k]);
+        inode->direct[k] = 0;
+    }
+
+    if (inode->indirect == 0) return;
+
+    union fs_block indirect;
+
+    // Nada continua sob o indireto: solta ele inteiro, como inode_release
+    if (remaining == 0) {
+        if (bitmap[inode->indirect] == 1) {
+            for (int k = POINTERS_PER_INODE; k < nblocks; k++) {
+                if (blocks[k] != 0) block_release(blocks[k]);
+            }
+        }
+        block_release(inode->indirect);
+        inode->indirect = 0;
+        return;
+    }
+
+    // O indireto vai mudar: se é compartilhado, passa a usar uma cópia própria
+    if (dropped == 0 || not indirect_private(inode)) return;
+
+    disk->read(inode->indirect, indirect.data);
+    for (int k = POINTERS_PER_INODE; k < nblocks; k++) {
+        if (not drop[k]) continue;
+        block_release(blocks[k]);
+        indirect.pointers[k - POINTERS_PER_INODE] = 0;
+    }
+    disk->write(inode->indirect, indirect.data);
+}
+
+// Monta a lista dos blocos no disco referentes aos nblocks primeiros blocos relativos ao inodo (0 se não alocado)
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_block_list(fs_inode *inode, int nblocks, std::vector<int> &blocks) {
+    union fs_block indirect;
+
+    blocks.clear();
+
+    if (nblocks > POINTERS_PER_INODE && inode->indirect != 0) {
+        disk->read(inode->indirect, indirect.data);
+    }
+
+    for (int pont = 0; pont < nblocks; pont++) {
+        if (pont < POINTERS_PER_INODE) {
+            blocks.push_back(inode->direct[pont]);
+        } else if (inode->indirect != 0) {
+            blocks.push_back(indirect.pointers[pont - POINTERS_PER_INODE]);
+        } else {
+            blocks.push_back(0);
+        }
+    }
+}
+
+// Atualiza o ponteiro do bloco relativo pont do inodo (direto no inodo ou no bloco indireto já alocado)
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_set_pointer(fs_inode *inode, int pont, int block) {
+    union fs_block indirect;
+
+    if (pont >= POINTERS_PER_INODE) {
+        indirect_private(inode);
+        disk->read(inode->indirect, indirect.data);
+        indirect.pointers[pont - POINTERS_PER_INODE] = block;
+        disk->write(inode->indirect, indirect.data);
+    } else {
+        inode->direct[pont] = block;
+    }
+}
+
+// Lista todos os blocos em uso na ordem em que ficariam num disco sem fragmentação: inodo por inodo, na ordem
+// em que transition aloca (blocos diretos, o bloco indireto com pont = -1 e então os blocos sob o indireto)
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::layout_order(std::vector<int> &inumbers, std::vector<int> &ponts, std::vector<int> &blocks) {
+    union fs_block block;
+
+    inumbers.clear();
+    ponts.clear();
+    blocks.clear();
+
+    disk->read(0, block.data);
+    int ninodeblocks = block.super.ninodeblocks;
+
+    for (int i = 0; i < ninodeblocks; i++) {
+        inode_block_read(i, block);
+
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            fs_inode inode = block.inode[j];
+            if (not inode.isvalid) continue;
+
+            int inumber = i * INODES_PER_BLOCK + j + 1;
+
+            std::vector<int> data_blocks;
+            inode_block_list(&inode, POINTERS_PER_INODE + (inode.indirect != 0 ? POINTERS_PER_BLOCK : 0), data_blocks);
+
+            for (size_t k = 0; k < data_blocks.size(); k++) {
+                if (k == POINTERS_PER_INODE) {
+                    inumbers.push_back(inumber);
+                    ponts.push_back(-1);
+                    blocks.push_back(inode.indirect);
+                }
+                if (data_blocks[k] == 0) continue;
+                inumbers.push_back(inumber);
+                ponts.push_back(k);
+                blocks.push_back(data_blocks[k]);
+            }
+        }
+    }
+}
+
+// Solta uma referência ao bloco; quando ninguém mais o referencia, volta a ficar livre
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::block_release(int block) {
+    if (bitmap[block] > 0) {
+        bitmap[block]--;
+    }
+    if (bitmap[block] == 0) {
+        dedup_erase(block);
+    }
+}
+
+// Hash do conteúdo do bloco (FNV-1a de 64 bits)
+template <int BLOCK_SIZE>
+unsigned long long INE5412_FS_Impl<BLOCK_SIZE>::block_hash(union fs_block &block) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        hash ^= (unsigned char) block.data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Procura um bloco já indexado com o mesmo conteúdo (retorna o número do bloco ou 0 se não houver)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dedup_find(unsigned long long hash, union fs_block &block) {
+    union fs_block other;
+
+    auto range = dedup_index.equal_range(hash);
+    for (auto it = range.first; it != range.second; it++) {
+        // Hash igual não garante conteúdo igual, confere byte a byte
+        disk->read(it->second, other.data);
+        if (memcmp(other.data, block.data, BLOCK_SIZE) == 0) {
+            return it->second;
+        }
+    }
+    return 0;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::dedup_insert(int block, unsigned long long hash) {
+    if (not dedup) return;
+    dedup_hash[block] = hash;
+    dedup_index.insert(std::make_pair(hash, block));
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::dedup_erase(int block) {
+    if (not dedup || dedup_hash[block] == 0) return;
+
+    auto range = dedup_index.equal_range(dedup_hash[block]);
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second == block) {
+            dedup_index.erase(it);
+            break;
+        }
+    }
+    dedup_hash[block] = 0;
+}
+
+// Leitura de um arquivo comprimido: descomprime só os blocos que contêm o trecho pedido
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::compressed_read(fs_inode *inode, char *data, int length, int offset) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    length = std::min(length, inode->size - offset);
+
+    std::vector<fs_extent> map(EXTENTS_PER_MAP);
+    compressed_load_map(inode, map);
+
+    union fs_block block;
+    int done = 0;
+
+    while (done < length) {
+        int num_block = (offset + done) / BLOCK_SIZE;
+        int pos_in_block = (offset + done) % BLOCK_SIZE;
+        int count = std::min(BLOCK_SIZE - pos_in_block, length - done);
+
+        if (not compressed_load_block(inode, map, num_block, block)) break;
+        memcpy(data + done, block.data + pos_in_block, count);
+        done += count;
+    }
+
+    return done;
+}
+
+// Escrita em um arquivo comprimido. Cada bloco alterado é comprimido de novo (se não ficar menor, vai sem
+// compressão) e gravado no lugar da versão anterior, se couber, ou acrescentado no fim do fluxo de dados do
+// inodo; o mapa no início do fluxo passa a apontar para a versão nova. Quando os trechos que não são mais usados
+// passam de um quarto do fluxo, ou quando o fluxo enche, eles são descartados (compactação).
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::compressed_write(int inumber, fs_inode *inode, const char *data, int length, int offset) {
+    int max_size = (EXTENTS_PER_MAP - 1) * BLOCK_SIZE;
+    int capacity = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * BLOCK_SIZE;
+
+    if (offset >= max_size) {
+        return 0;
+    }
+    length = std::min(length, max_size - offset);
+
+    std::vector<fs_extent> map(EXTENTS_PER_MAP);
+    compressed_load_map(inode, map);
+    bool fresh = inode->direct[0] == 0;
+    std::vector<fs_extent> loaded = map;
+
+    union fs_block block;
+    char packed[BLOCK_SIZE];
+    int done = 0;
+
+    while (done < length) {
+        int num_block = (offset + done) / BLOCK_SIZE;
+        int pos_in_block = (offset + done) % BLOCK_SIZE;
+        int count = std::min(BLOCK_SIZE - pos_in_block, length - done);
+
+        // Se não vai sobrescrever o bloco inteiro, parte do conteúdo atual
+        if (count < BLOCK_SIZE && not compressed_load_block(inode, map, num_block, block)) break;
+        memcpy(block.data + pos_in_block, data + done, count);
+
+        const char *payload = packed;
+        int plen = LZ_Codec::compress(block.data, BLOCK_SIZE, packed, BLOCK_SIZE - 1);
+        if (plen == 0) {
+            payload = block.data;
+            plen = BLOCK_SIZE;
+        }
+
+        fs_extent &extent = map[num_block + 1];
+
+        // Cabe no lugar da versão anterior: sobrescreve ali mesmo (o que sobrar do trecho fica sem uso)
+        if (extent.length >= plen) {
+            if (stream_write(inode, extent.offset, payload, plen) != plen) break;
+            extent.length = plen;
+            done += count;
+            continue;
+        }
+
+        // Sem espaço no fim do fluxo (ou no disco): compacta e tenta mais uma vez
+        if (map[0].offset + plen > capacity || stream_write(inode, map[0].offset, payload, plen) != plen) {
+            compressed_compact(inode, map);
+            if (map[0].offset + plen > capacity || stream_write(inode, map[0].offset, payload, plen) != plen) break;
+        }
+
+        extent.offset = map[0].offset;
+        extent.length = plen;
+        map[0].offset += plen;
+        done += count;
+    }
+
+    // Bytes do fluxo que nenhum bloco usa mais (versões antigas e sobras de sobrescritas)
+    int start = map.size() * sizeof(fs_extent);
+    int dead = map[0].offset - start;
+    for (size_t i = 1; i < map.size(); i++) {
+        dead -= map[i].length;
+    }
+    if (dead >= BLOCK_SIZE && 4 * dead > map[0].offset - start) {
+        compressed_compact(inode, map);
+    }
+
+    // Grava só os blocos do mapa que mudaram (todos, se o mapa ainda não existia no disco)
+    for (int b = 0; b < COMPRESSED_MAP_BLOCKS; b++) {
+        const char *now = (const char *) map.data() + b * BLOCK_SIZE;
+        if (fresh || memcmp(now, (const char *) loaded.data() + b * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+            stream_write(inode, b * BLOCK_SIZE, now, BLOCK_SIZE);
+        }
+    }
+
+    if (offset + done > inode->size) {
+        inode->size = offset + done;
+    }
+
+    // O conteúdo não diminuiu com a compressão: passa a guardar sem compressão
+    if (compressed_oversized(inode, map)) {
+        compressed_expand(inumber, inode);
+    }
+    return done;
+}
+
+// Carrega o mapa de um arquivo comprimido. A entrada 0 guarda em offset o fim do fluxo; a entrada
+// i + 1 diz onde está (offset, length) a versão comprimida do bloco i relativo ao arquivo (length 0 = só zeros)
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::compressed_load_map(fs_inode *inode, std::vector<fs_extent> &map) {
+    if (inode->direct[0] == 0) {
+        for (size_t i = 0; i < map.size(); i++) {
+            map[i].offset = 0;
+            map[i].length = 0;
+        }
+        map[0].offset = map.size() * sizeof(fs_extent);
+        return;
+    }
+    stream_read(inode, 0, (char *) map.data(), map.size() * sizeof(fs_extent));
+}
+
+// Descomprime o bloco num_block relativo ao arquivo
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::compressed_load_block(fs_inode *inode, std::vector<fs_extent> &map, int num_block, union fs_block &block) {
+    fs_extent extent = map[num_block + 1];
+
+    if (extent.length == 0) {
+        memset(block.data, 0, BLOCK_SIZE);
+        return 1;
+    }
+
+    // Bloco que não diminuiu com a compressão fica guardado como está
+    if (extent.length == BLOCK_SIZE) {
+        return stream_read(inode, extent.offset, block.data, extent.length) == extent.length;
+    }
+
+    char packed[BLOCK_SIZE];
+    if (stream_read(inode, extent.offset, packed, extent.length) != extent.length) {
+        return 0;
+    }
+    return LZ_Codec::decompress(packed, extent.length, block.data, BLOCK_SIZE) == BLOCK_SIZE;
+}
+
+// Reescreve os trechos ainda usados em sequência logo após o mapa, descartando as versões antigas,
+// e solta os blocos que ficaram depois do novo fim do fluxo
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::compressed_compact(fs_inode *inode, std::vector<fs_extent> &map) {
+    std::vector<char> live;
+
+    for (size_t i = 1; i < map.size(); i++) {
+        if (map[i].length == 0) continue;
+        size_t pos = live.size();
+        live.resize(pos + map[i].length);
+        stream_read(inode, map[i].offset, live.data() + pos, map[i].length);
+    }
+
+    int start = map.size() * sizeof(fs_extent);
+    stream_write(inode, start, live.data(), live.size());
+
+    int tail = start;
+    for (size_t i = 1; i < map.size(); i++) {
+        if (map[i].length == 0) continue;
+        map[i].offset = tail;
+        tail += map[i].length;
+    }
+    map[0].offset = tail;
+
+    std::vector<int> keep;
+    inode_trim(inode, (tail + BLOCK_SIZE - 1) / BLOCK_SIZE, keep);
+}
+
+// Se os trechos em uso somam pelo menos o tamanho do arquivo, ou seja, se o conteúdo não comprime. O mapa
+// fica de fora da conta: ele tem tamanho fixo, e um arquivo pequeno que ainda vai crescer não o pagaria
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::compressed_oversized(fs_inode *inode, std::vector<fs_extent> &map) {
+    int stored = 0;
+    for (size_t i = 1; i < map.size(); i++) {
+        stored += map[i].length;
+    }
+    return inode->size > 0 && stored >= inode->size;
+}
+
+// Passa a guardar o arquivo sem compressão: descomprime tudo, solta os blocos do fluxo e grava de novo
+// pelo caminho normal de fs_write. Só faz isso se os blocos livres garantem que nada se perde no caminho
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::compressed_expand(int inumber, fs_inode *inode) {
+    int size = inode->size;
+    int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // Blocos do fluxo compartilhados com um snapshot não ficam livres ao soltar, então conta só os já livres
+    int free_blocks = 0;
+    for (size_t b = 0; b < bitmap.size() && free_blocks <= nblocks; b++) {
+        if (bitmap[b] == 0) free_blocks++;
+    }
+    if (free_blocks <= nblocks) return 0;
+
+    std::vector<char> content(size);
+    if (compressed_read(inode, content.data(), size, 0) != size) return 0;
+
+    inode_release(inode);
+    inode->isvalid &= ~INODE_COMPRESSED;
+    inode->size = 0;
+    for (int k = 0; k < POINTERS_PER_INODE; k++) {
+        inode->direct[k] = 0;
+    }
+    inode->indirect = 0;
+    inode_save(inumber, inode);
+
+    fs_write(inumber, content.data(), size, 0);
+    inode_load(inumber, inode);
+    return 1;
+}
+
+// Lê length bytes a partir da posição offset do conteúdo bruto (sem descompressão) do inodo
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::stream_read(fs_inode *inode, int offset, char *data, int length) {
+    union fs_block block;
+    int done = 0;
+
+    while (done < length) {
+        int pont = (offset + done) / BLOCK_SIZE;
+        int pos_in_block = (offset + done) % BLOCK_SIZE;
+        int count = std::min(BLOCK_SIZE - pos_in_block, length - done);
+
+        inode_read_block(inode, pont, block);
+        memcpy(data + done, block.data + pos_in_block, count);
+        done += count;
+    }
+
+    return done;
+}
+
+// Escreve length bytes a partir da posição offset do conteúdo bruto do inodo, alocando o que faltar
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::stream_write(fs_inode *inode, int offset, const char *data, int length) {
+    int nblocks = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (inode_reserve(inode, nblocks) < nblocks) {
+        return 0;
+    }
+
+    union fs_block block;
+    int done = 0;
+
+    while (done < length) {
+        int pont = (offset + done) / BLOCK_SIZE;
+        int pos_in_block = (offset + done) % BLOCK_SIZE;
+        int count = std::min(BLOCK_SIZE - pos_in_block, length - done);
+
+        if (count < BLOCK_SIZE) {
+            inode_read_block(inode, pont, block);
+        }
+        memcpy(block.data + pos_in_block, data + done, count);
+        if (not inode_write_block(inode, pont, block)) break;
+        done += count;
+    }
+
+    return done;
+}
+
+// Soma as referências do inodo aos seus blocos no bitmap. Os blocos sob um indireto só são contados
+// na primeira vez que o indireto aparece, já que ele pode ser compartilhado com um snapshot
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_count(fs_inode *inode) {
+    for (int k = 0; k < POINTERS_PER_INODE; k++) {
+        if (inode->direct[k] != 0) bitmap[inode->direct[k]]++;
+    }
+
+    if (inode->indirect != 0) {
+        bitmap[inode->indirect]++;
+        if (bitmap[inode->indirect] > 1) return;
+
+        union fs_block indirect;
+        disk->read(inode->indirect, indirect.data);
+
+        for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+            if (indirect.pointers[k] != 0) bitmap[indirect.pointers[k]]++;
+        }
+    }
+}
+
+// Solta as referências do inodo aos seus blocos (o inverso de inode_count)
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_release(fs_inode *inode) {
+    for (int k = 0; k < POINTERS_PER_INODE; k++) {
+        if (inode->direct[k] != 0) block_release(inode->direct[k]);
+    }
+
+    if (inode->indirect != 0) {
+        // Blocos sob o indireto só são soltos quando ninguém mais usa o indireto
+        if (bitmap[inode->indirect] == 1) {
+            union fs_block indirect;
+            disk->read(inode->indirect, indirect.data);
+
+            for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+                if (indirect.pointers[k] != 0) block_release(indirect.pointers[k]);
+            }
+        }
+        block_release(inode->indirect);
+    }
+}
+
+// Garante que o bloco indireto do inodo não é compartilhado, fazendo uma cópia própria se for
+// (retorna 0 se não há bloco livre para a cópia)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::indirect_private(fs_inode *inode) {
+    if (inode->indirect == 0 || bitmap[inode->indirect] <= 1) {
+        return 1;
+    }
+
+    int copy = next_free_block();
+    // Se copy = 0, significa que não tem bloco livre
+    if (copy == 0) {
+        return 0;
+    }
+
+    union fs_block indirect;
+    disk->read(inode->indirect, indirect.data);
+    disk->write(copy, indirect.data);
+
+    // A cópia passa a ser mais uma referência a cada bloco de dados
+    for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+        if (indirect.pointers[k] != 0) bitmap[indirect.pointers[k]]++;
+    }
+
+    block_release(inode->indirect);
+    inode->indirect = copy;
+    return 1;
+}
+
+// Lê o bloco de inodos index (relativo à tabela de inodos), do snapshot montado se houver.
+// Bloco que o snapshot não copiou (sem inodos válidos) ou ainda não inicializado é lido como vazio
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_block_read(int index, union fs_block &block) {
+    int location = mounted_snapshot >= 0 ? snapshot_blocks[index] : index + 1;
+
+    if (location == 0 || (mounted_snapshot < 0 && index >= inode_hwm)) {
+        memset(block.data, 0, BLOCK_SIZE);
+        return;
+    }
+
+    disk->read(location, block.data);
+}
+
+// Carrega a partir do superbloco a cadeia de descritores do snapshot e a lista das cópias dos blocos de inodos
+// que eles guardam (retorna o primeiro descritor ou 0 se o snapshot não existe)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::snapshot_load(union fs_block &super, int snapshot, std::vector<int> &copies, std::vector<int> &descriptors) {
+    int desc_block = super.super.snapshots[snapshot];
+    int ninodeblocks = super.super.ninodeblocks;
+    union fs_block desc;
+
+    copies.clear();
+    descriptors.clear();
+
+    while (descriptors.empty() || (int) copies.size() < ninodeblocks) {
+        if (desc_block <= ninodeblocks || desc_block >= super.super.nblocks) {
+            return 0;
+        }
+
+        disk->read(desc_block, desc.data);
+        if (desc.snapshot.magic != FS_SNAPSHOT_MAGIC || desc.snapshot.ninodeblocks != ninodeblocks) {
+            return 0;
+        }
+
+        int count = std::min(SNAPSHOT_INODE_BLOCKS, ninodeblocks - (int) copies.size());
+        copies.insert(copies.end(), desc.snapshot.inode_blocks, desc.snapshot.inode_blocks + count);
+        descriptors.push_back(desc_block);
+        desc_block = desc.snapshot.next;
+    }
+
+    return descriptors[0];
+}
+
+// Quantos blocos de inodos estão inicializados (todos, se o sistema não foi formatado no modo preguiçoso)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::inode_blocks_initialized(union fs_block &super) {
+    int ninodeblocks = super.super.ninodeblocks;
+
+    if (not (super.super.features & FS_FEATURE_LAZY_INODES)) {
+        return ninodeblocks;
+    }
+    if (super.super.inode_hwm < 0 || super.super.inode_hwm > ninodeblocks) {
+        return ninodeblocks;
+    }
+    return super.super.inode_hwm;
+}
+
+// Registra no superbloco que os blocos de inodos abaixo de hwm estão inicializados
+template <int BLOCK_SIZE>
+void INE5412_FS_Impl<BLOCK_SIZE>::inode_hwm_advance(int hwm) {
+    union fs_block block;
+
+    disk->read(0, block.data);
+
+    inode_hwm = hwm;
+    block.super.inode_hwm = hwm;
+    // Com todos inicializados, o sistema volta a ser como um formatado normalmente
+    if (hwm >= block.super.ninodeblocks) {
+        block.super.features &= ~FS_FEATURE_LAZY_INODES;
+    }
+
+    disk->write(0, block.data);
+}
+
+// Resolve o caminho até o inodo (0 se não existe). Caminhos são sempre a partir da raiz, com ou sem '/' no começo
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_lookup(const char *path) {
+    int dir;
+    std::string name;
+
+    if (not path_resolve(path, dir, name)) return 0;
+    if (name.empty()) return dir;
+
+    return dir_lookup(dir, name);
+}
+
+// Cria um diretório vazio (retorna o inumber ou 0)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_mkdir(const char *path) {
+    int dir;
+    std::string name;
+
+    if (not is_mounted || mounted_snapshot >= 0) return 0;
+    if (not path_resolve(path, dir, name) || name.empty()) return 0;
+    if (dir_lookup(dir, name) != 0) return 0;
+
+    int inumber = fs_create(false);
+    if (inumber == 0) return 0;
+
+    if (not dir_init(inumber, dir) || not dir_insert(dir, name, inumber)) {
+        inode_free(inumber);
+        return 0;
+    }
+    return inumber;
+}
+
+// Cria um arquivo vazio com o nome dado (retorna o inumber ou 0)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_create_path(const char *path, bool compressed) {
+    int dir;
+    std::string name;
+
+    if (not is_mounted || mounted_snapshot >= 0) return 0;
+    if (not path_resolve(path, dir, name) || name.empty()) return 0;
+    if (dir_lookup(dir, name) != 0) return 0;
+
+    int inumber = fs_create(compressed);
+    if (inumber == 0) return 0;
+
+    fs_inode inode;
+    inode_load(inumber, &inode);
+    inode.isvalid |= INODE_NAMED;
+    inode_save(inumber, &inode);
+
+    if (not dir_insert(dir, name, inumber)) {
+        inode_free(inumber);
+        return 0;
+    }
+    return inumber;
+}
+
+// Remove o nome e apaga o inodo. Diretórios só podem ser removidos vazios
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_unlink(const char *path) {
+    int dir;
+    std::string name;
+
+    if (not is_mounted || mounted_snapshot >= 0) return 0;
+    if (not path_resolve(path, dir, name) || name.empty()) return 0;
+
+    int inumber = dir_lookup(dir, name);
+    if (inumber == 0) return 0;
+
+    fs_inode inode;
+    union fs_block header;
+    if (dir_load(inumber, &inode, header) && header.dir.nentries > 0) return 0;
+
+    if (not dir_remove(dir, name)) return 0;
+    return inode_free(inumber);
+}
+
+// Lista as entradas do diretório, na ordem em que estão na tabela hash
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::fs_readdir(const char *path, std::vector<fs_dirent> &entries) {
+    entries.clear();
+
+    int dir = fs_lookup(path);
+    if (dir == 0) return 0;
+
+    fs_inode inode;
+    union fs_block header, block;
+    if (not dir_load(dir, &inode, header)) return 0;
+
+    for (int pont = 1; pont <= header.dir.nbuckets; pont++) {
+        inode_read_block(&inode, pont, block);
+        entries.insert(entries.end(), block.bucket.entries, block.bucket.entries + block.bucket.count);
+    }
+    return 1;
+}
+
+// Apaga o inodo, soltando seus blocos
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::inode_free(int inumber) {
+    fs_inode inode;
+    if (not inode_load(inumber, &inode) or not inode.isvalid) {
+        return 0;
+    }
+
+    inode_release(&inode);
+
+    inode.isvalid = false;
+    inode_save(inumber, &inode);
+
+    inode_free_hint = std::min(inode_free_hint, (inumber - 1) / INODES_PER_BLOCK);
+    return 1;
+}
+
+// Inodo do diretório raiz. Um sistema de arquivos formatado antes dos diretórios ganha a raiz no primeiro uso
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::root_directory() {
+    if (root != 0 || not is_mounted || mounted_snapshot >= 0) return root;
+
+    int inumber = fs_create(false);
+    if (inumber == 0) return 0;
+
+    if (not dir_init(inumber, inumber)) {
+        inode_free(inumber);
+        return 0;
+    }
+
+    union fs_block block;
+    disk->read(0, block.data);
+    block.super.features |= FS_FEATURE_DIRECTORIES;
+    block.super.root = inumber;
+    disk->write(0, block.data);
+
+    root = inumber;
+    return root;
+}
+
+// Separa o caminho no diretório que contém a última parte e o nome dela. Segue "." e ".." pelo caminho;
+// se ele termina num diretório (a raiz, "." ou ".."), name fica vazio e dir é o próprio diretório
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::path_resolve(const char *path, int &dir, std::string &name) {
+    if (not is_mounted || path == NULL) return 0;
+
+    std::vector<std::string> parts;
+    for (const char *p = path; *p;) {
+        const char *end = strchrnul(p, '/');
+        if (end > p) parts.push_back(std::string(p, end - p));
+        p = *end ? end + 1 : end;
+    }
+
+    dir = root_directory();
+    if (dir == 0) return 0;
+
+    name.clear();
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        fs_inode inode;
+        union fs_block header;
+
+        if (parts[i].size() > (size_t) MAX_NAME_LENGTH) return 0;
+
+        // A última parte só é seguida se for "." ou ".."
+        bool last = i + 1 == parts.size();
+
+        if (parts[i] == ".") {
+            continue;
+        } else if (parts[i] == "..") {
+            if (not dir_load(dir, &inode, header)) return 0;
+            dir = header.dir.parent;
+        } else if (last) {
+            name = parts[i];
+        } else {
+            dir = dir_lookup(dir, parts[i]);
+            if (dir == 0) return 0;
+        }
+    }
+    return 1;
+}
+
+// Carrega o inodo e o cabeçalho do diretório (0 se o inodo não é um diretório)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_load(int dir, fs_inode *inode, union fs_block &header) {
+    if (not inode_load(dir, inode) or not (inode->isvalid & INODE_DIRECTORY)) {
+        return 0;
+    }
+
+    int pont = 0;
+    inode_read_block(inode, pont, header);
+    return header.dir.magic == FS_DIRECTORY_MAGIC;
+}
+
+// Transforma o inodo recém-criado num diretório vazio, com um balde só
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_init(int inumber, int parent) {
+    fs_inode inode;
+    if (not inode_load(inumber, &inode)) return 0;
+
+    inode.isvalid = 1 | INODE_DIRECTORY;
+    inode.size = 2 * BLOCK_SIZE;
+
+    union fs_block block;
+    int ok = inode_reserve(&inode, 2) == 2;
+
+    if (ok) {
+        memset(block.data, 0, BLOCK_SIZE);
+        block.dir.magic = FS_DIRECTORY_MAGIC;
+        block.dir.nbuckets = 1;
+        block.dir.nentries = 0;
+        block.dir.parent = parent;
+
+        int pont = 0;
+        ok = inode_write_block(&inode, pont, block);
+    }
+    if (ok) {
+        memset(block.data, 0, BLOCK_SIZE);
+
+        int pont = 1;
+        ok = inode_write_block(&inode, pont, block);
+    }
+
+    // Salva mesmo se falhou, para que os blocos já alocados sejam soltos quando o inodo for apagado
+    inode_save(inumber, &inode);
+    return ok;
+}
+
+// Procura o nome no diretório: primeiro no cache, depois no balde do hash do nome e, se ele transbordou,
+// nos seguintes (retorna o inumber ou 0)
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_lookup(int dir, const std::string &name) {
+    std::string key = dentry_key(dir, name);
+
+    auto it = dentry_cache.find(key);
+    if (it != dentry_cache.end()) {
+        return it->second;
+    }
+
+    fs_inode inode;
+    union fs_block header, block;
+    if (not dir_load(dir, &inode, header)) return 0;
+
+    int nbuckets = header.dir.nbuckets;
+    int b = name_hash(name) % nbuckets;
+
+    for (int probe = 0; probe < nbuckets; probe++) {
+        int pont = b + 1;
+        inode_read_block(&inode, pont, block);
+
+        for (int i = 0; i < block.bucket.count; i++) {
+            if (name == block.bucket.entries[i].name) {
+                // Cache cheio: recomeça do zero em vez de manter uma ordem de uso
+                if (dentry_cache.size() >= DENTRY_CACHE_MAX) {
+                    dentry_cache.clear();
+                }
+                dentry_cache[key] = block.bucket.entries[i].inumber;
+                return block.bucket.entries[i].inumber;
+            }
+        }
+
+        if (not block.bucket.overflow) break;
+        b = (b + 1) % nbuckets;
+    }
+    return 0;
+}
+
+// Acrescenta a entrada no primeiro balde com espaço a partir do balde do hash do nome, marcando os
+// baldes cheios pelo caminho. Passando de 3/4 da capacidade, a tabela dobra de tamanho antes
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_insert(int dir, const std::string &name, int inumber) {
+    if (name.empty() || name.size() > (size_t) MAX_NAME_LENGTH) return 0;
+    if (dir_lookup(dir, name) != 0) return 0;
+
+    fs_inode inode;
+    union fs_block header, block;
+    if (not dir_load(dir, &inode, header)) return 0;
+
+    // Se não der para crescer (tamanho máximo ou disco cheio), continua enchendo a tabela atual
+    if (header.dir.nentries >= header.dir.nbuckets * DIRENTS_PER_BUCKET / 4 * 3) {
+        dir_grow(dir, &inode, header);
+    }
+
+    int nbuckets = header.dir.nbuckets;
+    if (header.dir.nentries >= nbuckets * DIRENTS_PER_BUCKET) return 0;
+
+    int b = name_hash(name) % nbuckets;
+
+    for (int probe = 0; probe < nbuckets; probe++) {
+        int pont = b + 1;
+        inode_read_block(&inode, pont, block);
+
+        if (block.bucket.count < DIRENTS_PER_BUCKET) {
+            fs_dirent &entry = block.bucket.entries[block.bucket.count++];
+            memset(&entry, 0, sizeof(entry));
+            entry.inumber = inumber;
+            strcpy(entry.name, name.c_str());
+
+            if (not dir_write_block(dir, &inode, pont, block)) return 0;
+            break;
+        }
+
+        if (not block.bucket.overflow) {
+            block.bucket.overflow = 1;
+            if (not dir_write_block(dir, &inode, pont, block)) return 0;
+        }
+        b = (b + 1) % nbuckets;
+    }
+
+    header.dir.nentries++;
+    dir_write_block(dir, &inode, 0, header);
+
+    if (dentry_cache.size() >= DENTRY_CACHE_MAX) {
+        dentry_cache.clear();
+    }
+    dentry_cache[dentry_key(dir, name)] = inumber;
+    return 1;
+}
+
+// Tira a entrada do balde, movendo a última dele para o lugar. As marcas de transbordo ficam
+// (só custam uma leitura a mais) e somem quando a tabela crescer
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_remove(int dir, const std::string &name) {
+    fs_inode inode;
+    union fs_block header, block;
+    if (not dir_load(dir, &inode, header)) return 0;
+
+    int nbuckets = header.dir.nbuckets;
+    int b = name_hash(name) % nbuckets;
+
+    for (int probe = 0; probe < nbuckets; probe++) {
+        int pont = b + 1;
+        inode_read_block(&inode, pont, block);
+
+        for (int i = 0; i < block.bucket.count; i++) {
+            if (name != block.bucket.entries[i].name) continue;
+
+            block.bucket.entries[i] = block.bucket.entries[--block.bucket.count];
+            memset(&block.bucket.entries[block.bucket.count], 0, sizeof(fs_dirent));
+            if (not dir_write_block(dir, &inode, pont, block)) return 0;
+
+            header.dir.nentries--;
+            dir_write_block(dir, &inode, 0, header);
+
+            dentry_cache.erase(dentry_key(dir, name));
+            return 1;
+        }
+
+        if (not block.bucket.overflow) break;
+        b = (b + 1) % nbuckets;
+    }
+    return 0;
+}
+
+// Dobra a quantidade de baldes (até o tamanho máximo de um arquivo) e redistribui as entradas. Elas são
+// ordenadas pelo balde novo, então cada balde é gravado uma vez só; o que não couber num balde passa ao seguinte
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_grow(int dir, fs_inode *inode, union fs_block &header) {
+    int old_buckets = header.dir.nbuckets;
+    int nbuckets = std::min(2 * old_buckets, (int) MAX_BUCKETS);
+    if (nbuckets <= old_buckets) return 0;
+
+    if (inode_reserve(inode, nbuckets + 1) < nbuckets + 1) {
+        inode_save(dir, inode);
+        return 0;
+    }
+    inode->size = (nbuckets + 1) * BLOCK_SIZE;
+
+    union fs_block block;
+    std::vector<fs_dirent> entries;
+    entries.reserve(header.dir.nentries);
+
+    for (int pont = 1; pont <= old_buckets; pont++) {
+        inode_read_block(inode, pont, block);
+        entries.insert(entries.end(), block.bucket.entries, block.bucket.entries + block.bucket.count);
+    }
+
+    std::vector<std::pair<int, int>> order; // (balde novo, entrada)
+    for (size_t i = 0; i < entries.size(); i++) {
+        order.push_back(std::make_pair((int) (name_hash(entries[i].name) % nbuckets), (int) i));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<int> carry; // Entradas esperando um balde com espaço, na ordem em que chegaram
+    size_t next = 0, head = 0;
+
+    for (int b = 0; b < nbuckets; b++) {
+        while (next < order.size() && order[next].first == b) {
+            carry.push_back(order[next++].second);
+        }
+
+        memset(block.data, 0, BLOCK_SIZE);
+        while (head < carry.size() && block.bucket.count < DIRENTS_PER_BUCKET) {
+            block.bucket.entries[block.bucket.count++] = entries[carry[head++]];
+        }
+        block.bucket.overflow = head < carry.size();
+
+        if (not dir_write_block(dir, inode, b + 1, block)) return 0;
+    }
+
+    // O que transbordou do último balde volta para o começo da tabela
+    for (int b = 0; head < carry.size(); b++) {
+        int pont = b + 1;
+        inode_read_block(inode, pont, block);
+        while (head < carry.size() && block.bucket.count < DIRENTS_PER_BUCKET) {
+            block.bucket.entries[block.bucket.count++] = entries[carry[head++]];
+        }
+        block.bucket.overflow = block.bucket.overflow || head < carry.size();
+
+        if (not dir_write_block(dir, inode, pont, block)) return 0;
+    }
+
+    header.dir.nbuckets = nbuckets;
+    dir_write_block(dir, inode, 0, header);
+    inode_save(dir, inode);
+    return 1;
+}
+
+// Grava um bloco do diretório; se o copy-on-write ou a deduplicação mudaram os ponteiros, salva o inodo
+template <int BLOCK_SIZE>
+int INE5412_FS_Impl<BLOCK_SIZE>::dir_write_block(int dir, fs_inode *inode, int pont, union fs_block &block) {
+    fs_inode before = *inode;
+
+    if (not inode_write_block(inode, pont, block)) return 0;
+
+    if (memcmp(&before, inode, sizeof(fs_inode)) != 0) {
+        inode_save(dir, inode);
+    }
+    return 1;
+}
+
+// Hash do nome (FNV-1a de 64 bits)
+template <int BLOCK_SIZE>
+unsigned long long INE5412_FS_Impl<BLOCK_SIZE>::name_hash(const std::string &name) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < name.size(); i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Chave do cache de dentries: o inumber do diretório em binário seguido do nome
+template <int BLOCK_SIZE>
+std::string INE5412_FS_Impl<BLOCK_SIZE>::dentry_key(int dir, const std::string &name) {
+    return std::string((const char *) &dir, sizeof(dir)) + name;
+}
+
+template class INE5412_FS_Impl<1024>;
+template class INE5412_FS_Impl<2048>;
+template class INE5412_FS_Impl<4096>;
+template class INE5412_FS_Impl<8192>;
+template class INE5412_FS_Impl<16384>;
+template class INE5412_FS_Impl<32768>;
+template class INE5412_FS_Impl<65536>;
@@ -5,15 +5,31 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <string>
 
 
+// Interface do sistema de arquivos, independente do tamanho de bloco. A implementação (INE5412_FS_Impl)
+// é especializada em tempo de compilação para cada tamanho de bloco suportado; create escolhe a certa.
 class INE5412_FS
 {
 public:
     static const unsigned int FS_MAGIC = 0xf0f03410;
-    static const unsigned short int INODES_PER_BLOCK = 128;
+    static const unsigned int FS_SNAPSHOT_MAGIC = 0xf0f05a70;
+    static const unsigned int FS_DIRECTORY_MAGIC = 0xf0f0d1e0;
+    static const unsigned int FS_FEATURE_LAZY_INODES = 1; // Blocos de inodos a partir de inode_hwm não inicializados
+    static const unsigned int FS_FEATURE_DIRECTORIES = 2; // Diretório raiz criado (em superblock.root)
+    static const unsigned int FS_FEATURE_DEDUP = 4; // Deduplicação de blocos ligada (o índice é refeito ao montar)
     static const unsigned short int POINTERS_PER_INODE = 5;
-    static const unsigned short int POINTERS_PER_BLOCK = 1024;
+    static const unsigned short int COMPRESSED_MAP_BLOCKS = 2;
+    static const int INODE_COMPRESSED = 2; // Bit de isvalid que marca arquivo comprimido
+    static const int INODE_DIRECTORY = 4; // Bit de isvalid que marca diretório
+    static const int INODE_NAMED = 8; // Bit de isvalid que marca arquivo com nome num diretório
+    static const int MAX_NAME_LENGTH = 27; // Maior nome de uma entrada de diretório
+    static const unsigned short int MAX_SNAPSHOTS = 8;
+    static const int MIN_BLOCK_SIZE = 1024;
+    static const int MAX_BLOCK_SIZE = 65536;
 
     class fs_superblock {
         public:
@@ -21,6 +37,11 @@ public:
             int nblocks;
             int ninodeblocks;
             int ninodes;
+            int snapshots[MAX_SNAPSHOTS]; // Bloco do descritor de cada snapshot (0 = livre)
+            unsigned int features;
+            int inode_hwm; // Blocos de inodos já inicializados (com FS_FEATURE_LAZY_INODES)
+            int block_size; // Tamanho do bloco em bytes (0 = Disk::DISK_BLOCK_SIZE)
+            int root; // Inodo do diretório raiz (com FS_FEATURE_DIRECTORIES)
     };
 
     class fs_inode {
@@ -31,42 +52,211 @@ public:
             int indirect;
     };
 
+    class fs_extent {
+        public:
+            int offset;
+            int length;
+    };
+
+    class fs_dirent {
+        public:
+            int inumber;
+            char name[MAX_NAME_LENGTH + 1];
+    };
+
+    class fs_frag_report {
+        public:
+            int files;
+            int blocks;
+            int extents;
+            int free_blocks;
+            int free_extents;
+    };
+
+public:
+
+    virtual ~INE5412_FS() {}
+
+    static INE5412_FS *create(Disk *d);
+    static int probe_block_size(const char *filename);
+
+    virtual void fs_debug() = 0;
+    virtual int  fs_format(bool lazy = false) = 0;
+    virtual int  fs_mount(int snapshot = -1) = 0;
+    virtual int  fs_unmount() = 0;
+    virtual int  fs_init_inodes(int count) = 0;
+
+    virtual int  fs_create(bool compressed = false) = 0;
+    virtual int  fs_delete(int inumber) = 0;
+    virtual int  fs_getsize(int inumber) = 0;
+
+    virtual int  fs_read(int inumber, char *data, int length, int offset) = 0;
+    virtual int  fs_write(int inumber, const char *data, int length, int offset) = 0;
+
+    virtual int  fs_export(int inumber, int fd) = 0;
+    virtual int  fs_import(int inumber, int fd) = 0;
+
+    virtual int  fs_fragmentation(fs_frag_report *report) = 0;
+    virtual int  fs_defrag(int max_moves) = 0;
+
+    virtual int  fs_dedup(bool enable) = 0;
+
+    virtual int  fs_snapshot_create() = 0;
+    virtual int  fs_snapshot_delete(int snapshot) = 0;
+
+    virtual int  fs_lookup(const char *path) = 0;
+    virtual int  fs_mkdir(const char *path) = 0;
+    virtual int  fs_create_path(const char *path, bool compressed = false) = 0;
+    virtual int  fs_unlink(const char *path) = 0;
+    virtual int  fs_readdir(const char *path, std::vector<fs_dirent> &entries) = 0;
+};
+
+template <int BLOCK_SIZE>
+class INE5412_FS_Impl : public INE5412_FS
+{
+public:
+    static constexpr int INODES_PER_BLOCK = BLOCK_SIZE / sizeof(fs_inode);
+    static constexpr int POINTERS_PER_BLOCK = BLOCK_SIZE / sizeof(int);
+    static constexpr int EXTENTS_PER_MAP = COMPRESSED_MAP_BLOCKS * BLOCK_SIZE / sizeof(fs_extent);
+    static constexpr int SNAPSHOT_INODE_BLOCKS = POINTERS_PER_BLOCK - 3; // Cópias listadas em cada descritor
+    static constexpr int DIRENTS_PER_BUCKET = (BLOCK_SIZE - 2 * sizeof(int)) / sizeof(fs_dirent);
+    static constexpr int MAX_BUCKETS = POINTERS_PER_INODE + POINTERS_PER_BLOCK - 1;
+    static constexpr size_t DENTRY_CACHE_MAX = 1 << 16;
+
+    class fs_snapshot {
+        public:
+            unsigned int magic;
+            int ninodeblocks;
+            int next; // Próximo descritor, quando a tabela de inodos não cabe num só (0 = último)
+            int inode_blocks[SNAPSHOT_INODE_BLOCKS]; // Cópia de cada bloco de inodos (0 = sem inodos válidos)
+    };
+
+    // Primeiro bloco de um diretório; os seguintes são os baldes da tabela hash
+    class fs_dir_header {
+        public:
+            unsigned int magic;
+            int nbuckets;
+            int nentries;
+            int parent; // Diretório pai (a raiz é pai de si mesma)
+    };
+
+    class fs_bucket {
+        public:
+            int count;
+            int overflow; // Alguma entrada que cairia aqui (ou antes) foi parar num balde seguinte
+            fs_dirent entries[DIRENTS_PER_BUCKET];
+    };
+
     union fs_block {
         public:
             fs_superblock super;
+            fs_snapshot snapshot;
+            fs_dir_header dir;
+            fs_bucket bucket;
             fs_inode inode[INODES_PER_BLOCK];
             int pointers[POINTERS_PER_BLOCK];
-            char data[Disk::DISK_BLOCK_SIZE];
+            char data[BLOCK_SIZE];
     };
 
 public:
 
-    INE5412_FS(Disk *d) {
+    INE5412_FS_Impl(Disk *d) {
         disk = d;
     }
 
     void fs_debug();
-    int  fs_format();
-    int  fs_mount();
+    int  fs_format(bool lazy = false);
+    int  fs_mount(int snapshot = -1);
+    int  fs_unmount();
+    int  fs_init_inodes(int count);
 
-    int  fs_create();
+    int  fs_create(bool compressed = false);
     int  fs_delete(int inumber);
     int  fs_getsize(int inumber);
 
     int  fs_read(int inumber, char *data, int length, int offset);
     int  fs_write(int inumber, const char *data, int length, int offset);
 
+    int  fs_export(int inumber, int fd);
+    int  fs_import(int inumber, int fd);
+
+    int  fs_fragmentation(fs_frag_report *report);
+    int  fs_defrag(int max_moves);
+
+    int  fs_dedup(bool enable);
+
+    int  fs_snapshot_create();
+    int  fs_snapshot_delete(int snapshot);
+
+    int  fs_lookup(const char *path);
+    int  fs_mkdir(const char *path);
+    int  fs_create_path(const char *path, bool compressed = false);
+    int  fs_unlink(const char *path);
+    int  fs_readdir(const char *path, std::vector<fs_dirent> &entries);
+
 private:
     Disk *disk;
     bool is_mounted{false};
-    std::vector<int> bitmap;
+    std::vector<int> bitmap; // Quantidade de referências a cada bloco (0 = livre)
+
+    bool dedup{false};
+    std::unordered_multimap<unsigned long long, int> dedup_index; // Hash do conteúdo -> bloco
+    std::vector<unsigned long long> dedup_hash; // Hash indexado de cada bloco (0 = não indexado)
+
+    int mounted_snapshot{-1}; // Snapshot montado (somente leitura) ou -1
+    std::vector<int> snapshot_blocks; // Cópias dos blocos de inodos do snapshot montado
+    int inode_hwm{0}; // Blocos de inodos já inicializados
+    int root{0}; // Inodo do diretório raiz (0 = ainda não criado)
+    int inode_free_hint{0}; // Primeiro bloco de inodos que pode ter um inodo livre
+    std::unordered_map<std::string, int> dentry_cache; // (diretório, nome) -> inodo
 
     int inode_load(int inumber, fs_inode *inode);
     int inode_save(int inumber, fs_inode *inode);
     int next_free_block();
     int transition(fs_inode *inode, int &pont, int &block_pos);
-    void inode_write_block(fs_inode *inode, int &pont, union fs_block &block);
+    int inode_write_block(fs_inode *inode, int &pont, union fs_block &block);
     void inode_read_block(fs_inode *inode, int&pont, union fs_block &block);
+    int inode_reserve(fs_inode *inode, int nblocks);
+    void inode_trim(fs_inode *inode, int from, std::vector<int> &keep);
+    void inode_block_list(fs_inode *inode, int nblocks, std::vector<int> &blocks);
+    void inode_set_pointer(fs_inode *inode, int pont, int block);
+    int import_buffered(int inumber, int fd, int size);
+    int compressed_read(fs_inode *inode, char *data, int length, int offset);
+    int compressed_write(int inumber, fs_inode *inode, const char *data, int length, int offset);
+    void compressed_load_map(fs_inode *inode, std::vector<fs_extent> &map);
+    int compressed_load_block(fs_inode *inode, std::vector<fs_extent> &map, int num_block, union fs_block &block);
+    void compressed_compact(fs_inode *inode, std::vector<fs_extent> &map);
+    int compressed_oversized(fs_inode *inode, std::vector<fs_extent> &map);
+    int compressed_expand(int inumber, fs_inode *inode);
+    int stream_read(fs_inode *inode, int offset, char *data, int length);
+    int stream_write(fs_inode *inode, int offset, const char *data, int length);
+    void block_release(int block);
+    void inode_count(fs_inode *inode);
+    void inode_release(fs_inode *inode);
+    int indirect_private(fs_inode *inode);
+    void inode_block_read(int index, union fs_block &block);
+    int inode_blocks_initialized(union fs_block &super);
+    void inode_hwm_advance(int hwm);
+    int snapshot_load(union fs_block &super, int snapshot, std::vector<int> &copies, std::vector<int> &descriptors);
+    unsigned long long block_hash(union fs_block &block);
+    int dedup_find(unsigned long long hash, union fs_block &block);
+    void dedup_insert(int block, unsigned long long hash);
+    void dedup_erase(int block);
+    void layout_order(std::vector<int> &inumbers, std::vector<int> &ponts, std::vector<int> &blocks);
+    bool layout_adjacent(std::vector<int> &inumbers, std::vector<int> &blocks, int k);
+    void defrag_move(int inumber, int pont, int from, int to);
+    int inode_free(int inumber);
+    int root_directory();
+    int path_resolve(const char *path, int &dir, std::string &name);
+    int dir_load(int dir, fs_inode *inode, union fs_block &header);
+    int dir_init(int inumber, int parent);
+    int dir_lookup(int dir, const std::string &name);
+    int dir_insert(int dir, const std::string &name, int inumber);
+    int dir_remove(int dir, const std::string &name);
+    int dir_grow(int dir, fs_inode *inode, union fs_block &header);
+    int dir_write_block(int dir, fs_inode *inode, int pont, union fs_block &block);
+    unsigned long long name_hash(const std::string &name);
+    std::string dentry_key(int dir, const std::string &name);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,55 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Protocolo do simplefs_server. Cada requisição é um request seguido, nas operações com has_payload,
+// de length bytes (os dados em OP_WRITE, o caminho nas operações por nome); cada resposta é um reply
+// seguido, só em OP_READ, de length bytes lidos.
+// Os inteiros vão na ordem de bytes da máquina, já que o socket é local.
+//
+// Um cliente pode mandar várias requisições sem esperar as respostas: elas são atendidas e
+// respondidas na ordem em que chegaram, e o id de cada uma volta na resposta.
+class FS_Protocol
+{
+public:
+    static const int MAX_PAYLOAD = 1 << 20; // Maior length aceito em OP_READ/OP_WRITE
+
+    enum op {
+        OP_FORMAT = 1,  // flags: FLAG_LAZY; result de fs_format
+        OP_MOUNT,       // inumber: snapshot (-1 = sistema de arquivos atual); result de fs_mount
+        OP_UNMOUNT,     // result de fs_unmount
+        OP_CREATE,      // flags: FLAG_COMPRESSED; caminho opcional; result: inumber criado ou 0
+        OP_DELETE,      // inumber; result de fs_delete (-1 se é um diretório ou arquivo com nome: use OP_UNLINK)
+        OP_GETSIZE,     // inumber; result: tamanho ou -1
+        OP_READ,        // inumber, offset, length; result: bytes lidos, que vêm depois da resposta
+        OP_WRITE,       // inumber, offset, length e os dados; result: bytes escritos
+        OP_LOOKUP,      // caminho; result: inumber ou 0
+        OP_MKDIR,       // caminho; result: inumber do diretório criado ou 0
+        OP_UNLINK       // caminho; result de fs_unlink
+    };
+
+    static const unsigned short FLAG_LAZY = 1;
+    static const unsigned short FLAG_COMPRESSED = 2;
+
+    static bool has_payload(int op) {
+        return op == OP_WRITE || op == OP_CREATE || op == OP_LOOKUP || op == OP_MKDIR || op == OP_UNLINK;
+    }
+
+    class request {
+        public:
+            unsigned short op;
+            unsigned short flags;
+            unsigned int id;
+            int inumber;
+            int offset;
+            int length;
+    };
+
+    class reply {
+        public:
+            unsigned int id;
+            int result;
+            int length; // Bytes de dados depois da resposta
+    };
+};
+
+#endif
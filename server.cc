@@ -0,0 +1,471 @@
+#include "fs.h"
+#include "disk.h"
+#include "stripe.h"
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// Atende vários clientes por um socket Unix num único laço de eventos com poll. O sistema de
+// arquivos não é thread-safe, então cada requisição roda inteira antes da próxima; o que o laço
+// ganha é não bloquear num cliente lento e juntar o trabalho de várias requisições.
+class FS_Server
+{
+public:
+	FS_Server(INE5412_FS *fs);
+
+	int  listen_on(const char *path);
+	void run();
+	void shutdown();
+
+	static volatile sig_atomic_t stop;
+
+private:
+	class client {
+		public:
+			int fd;
+			std::vector<char> in; // Recebido e ainda não atendido
+			std::vector<char> out; // Respostas ainda não enviadas
+			size_t sent; // Parte de out já enviada
+			bool closing; // O cliente fechou o envio: sai assim que receber as respostas
+			bool failed;
+	};
+
+	static const int RECV_CHUNK = 65536;
+	static const size_t MAX_PENDING_INPUT = 2 * FS_Protocol::MAX_PAYLOAD; // Cabe ao menos uma escrita inteira
+	static const size_t MAX_PENDING_OUTPUT = 4 << 20; // Acima disso para de ler do cliente até ele consumir as respostas
+
+	void accept_clients();
+	void receive(client &c);
+	void process(client &c);
+	void send_pending(client &c);
+	void execute(client &c, const FS_Protocol::request &req, const std::string &path);
+	void execute_batch(client &c, const std::vector<FS_Protocol::request> &batch, const std::vector<size_t> &payloads);
+	void reply(client &c, unsigned int id, int result, const char *data = NULL, int length = 0);
+
+	INE5412_FS *fs;
+	int listenfd;
+	std::string path;
+	std::vector<client> clients;
+
+	long long nrequests;
+	long long nbatches; // Chamadas a fs_read/fs_write, cada uma atendendo uma ou mais requisições
+};
+
+volatile sig_atomic_t FS_Server::stop = 0;
+
+static void handle_signal(int)
+{
+	FS_Server::stop = 1;
+}
+
+int main( int argc, char *argv[] )
+{
+	if(argc < 4 || argc > 6) {
+		cout << "use: " << argv[0] << " <diskfile>[,<diskfile>...] <nblocks> <socket> [blocksize] [stripe chunk]\n";
+		return 1;
+	}
+
+	std::string diskname = argv[1];
+	std::vector<std::string> filenames;
+	for(char *name = strtok(argv[1], ","); name; name = strtok(NULL, ",")) {
+		filenames.push_back(name);
+	}
+
+	int blocksize = argc >= 5 ? atoi(argv[4]) : (filenames.size() > 1 ? StripedDisk::probe_block_size(filenames[0].c_str())
+	                                           : INE5412_FS::probe_block_size(filenames[0].c_str()));
+	if(!blocksize) blocksize = Disk::DISK_BLOCK_SIZE;
+
+	Disk *disk;
+	if(filenames.size() > 1) {
+		disk = new StripedDisk(filenames, atoi(argv[2]), blocksize, argc == 6 ? atoi(argv[5]) : 0);
+	} else {
+		disk = new Disk(filenames[0].c_str(), atoi(argv[2]), blocksize);
+	}
+	if(!disk->is_open()) {
+		delete disk;
+		return 1;
+	}
+
+	INE5412_FS *fs = INE5412_FS::create(disk);
+	if(!fs) {
+		cout << "unsupported block size " << blocksize << " (use a power of two from "
+		     << INE5412_FS::MIN_BLOCK_SIZE << " to " << INE5412_FS::MAX_BLOCK_SIZE << ")\n";
+		delete disk;
+		return 1;
+	}
+
+	cout << "opened emulated disk image " << diskname << " with " << disk->size() << " blocks of " << blocksize << " bytes\n";
+
+	// Já deixa montado, se a imagem estiver formatada; os clientes ainda podem formatar e remontar
+	if(fs->fs_mount()) {
+		cout << "disk mounted.\n";
+	}
+
+	FS_Server server(fs);
+	if(!server.listen_on(argv[3])) {
+		disk->close();
+		delete fs;
+		delete disk;
+		return 1;
+	}
+
+	// Sem SA_RESTART, para o poll voltar com EINTR e o laço ver stop
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	cout << "listening on " << argv[3] << "\n";
+	fflush(stdout);
+
+	server.run();
+	server.shutdown();
+
+	cout << "closing emulated disk.\n";
+	disk->close();
+	delete fs;
+	delete disk;
+
+	return 0;
+}
+
+FS_Server::FS_Server(INE5412_FS *f)
+{
+	fs = f;
+	listenfd = -1;
+	nrequests = 0;
+	nbatches = 0;
+}
+
+int FS_Server::listen_on(const char *p)
+{
+	struct sockaddr_un addr;
+
+	if(strlen(p) >= sizeof(addr.sun_path)) {
+		cout << "socket path too long: " << p << "\n";
+		return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, p);
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listenfd < 0) {
+		cout << "couldn't create socket: " << strerror(errno) << "\n";
+		return 0;
+	}
+
+	// Um socket que sobrou de uma execução anterior impediria o bind
+	unlink(p);
+
+	if(bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listenfd, SOMAXCONN) < 0) {
+		cout << "couldn't listen on " << p << ": " << strerror(errno) << "\n";
+		::close(listenfd);
+		listenfd = -1;
+		return 0;
+	}
+
+	path = p;
+	return 1;
+}
+
+void FS_Server::run()
+{
+	std::vector<struct pollfd> fds;
+
+	while(!stop) {
+		fds.resize(clients.size() + 1);
+
+		fds[0].fd = listenfd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		for(size_t i = 0; i < clients.size(); i++) {
+			client &c = clients[i];
+			size_t pending = c.out.size() - c.sent;
+
+			fds[i + 1].fd = c.fd;
+			fds[i + 1].events = (pending ? POLLOUT : 0) | (pending < MAX_PENDING_OUTPUT && !c.closing ? POLLIN : 0);
+			fds[i + 1].revents = 0;
+		}
+
+		if(poll(fds.data(), fds.size(), -1) < 0) {
+			if(errno == EINTR) continue;
+			cout << "poll failed: " << strerror(errno) << "\n";
+			break;
+		}
+
+		for(size_t i = 0; i < clients.size(); i++) {
+			client &c = clients[i];
+			short revents = fds[i + 1].revents;
+
+			if(revents & (POLLIN | POLLHUP | POLLERR)) {
+				receive(c);
+			}
+
+			// Se process parou pela saída cheia e send_pending conseguiu mandar tudo, ninguém mais acordaria
+			// o poll para as requisições que sobraram no buffer: continua enquanto houver progresso
+			size_t before;
+			do {
+				before = c.in.size();
+				process(c);
+				send_pending(c);
+			} while(!c.failed && c.in.size() < before && c.out.empty());
+		}
+
+		// Descarta quem deu erro ou já fechou e recebeu todas as respostas
+		for(size_t i = 0; i < clients.size();) {
+			client &c = clients[i];
+			if(c.failed || (c.closing && c.sent == c.out.size())) {
+				::close(c.fd);
+				clients.erase(clients.begin() + i);
+			} else {
+				i++;
+			}
+		}
+
+		if(fds[0].revents & POLLIN) {
+			accept_clients();
+		}
+	}
+}
+
+void FS_Server::shutdown()
+{
+	for(size_t i = 0; i < clients.size(); i++) {
+		::close(clients[i].fd);
+	}
+	clients.clear();
+
+	if(listenfd >= 0) {
+		::close(listenfd);
+		unlink(path.c_str());
+		listenfd = -1;
+	}
+
+	cout << nrequests << " requests served with " << nbatches << " reads/writes\n";
+}
+
+void FS_Server::accept_clients()
+{
+	while(1) {
+		int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) break;
+
+		client c;
+		c.fd = fd;
+		c.sent = 0;
+		c.closing = false;
+		c.failed = false;
+		clients.push_back(c);
+	}
+}
+
+// Lê o que o cliente já mandou, sem bloquear (no máximo MAX_PENDING_INPUT por rodada)
+void FS_Server::receive(client &c)
+{
+	while(!c.closing && c.in.size() < MAX_PENDING_INPUT) {
+		size_t used = c.in.size();
+		c.in.resize(used + RECV_CHUNK);
+
+		ssize_t result = recv(c.fd, c.in.data() + used, RECV_CHUNK, 0);
+		c.in.resize(used + (result > 0 ? result : 0));
+
+		if(result == 0) {
+			c.closing = true;
+		} else if(result < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) c.failed = true;
+			break;
+		}
+	}
+}
+
+// Atende as requisições completas que estão no buffer de entrada. Leituras (ou escritas) seguidas
+// no mesmo inodo, em que cada uma começa onde a anterior termina, viram uma só chamada a fs_read
+// (ou fs_write), dividida de volta entre as respostas. Para quando as respostas ainda não enviadas
+// passam de MAX_PENDING_OUTPUT; o resto fica no buffer até o cliente consumir o que já foi respondido.
+void FS_Server::process(client &c)
+{
+	const size_t header = sizeof(FS_Protocol::request);
+	size_t pos = 0;
+
+	while(!c.failed && c.in.size() - pos >= header && c.out.size() - c.sent < MAX_PENDING_OUTPUT) {
+		FS_Protocol::request req;
+		memcpy(&req, &c.in[pos], header);
+
+		if(req.length < 0 || req.length > FS_Protocol::MAX_PAYLOAD) {
+			cout << "client sent an invalid request, closing connection\n";
+			c.failed = true;
+			break;
+		}
+
+		size_t total = header + (FS_Protocol::has_payload(req.op) ? req.length : 0);
+		if(c.in.size() - pos < total) break;
+
+		if((req.op != FS_Protocol::OP_READ && req.op != FS_Protocol::OP_WRITE) || req.offset < 0) {
+			execute(c, req, std::string(c.in.data() + pos + header, total - header));
+			pos += total;
+			continue;
+		}
+
+		std::vector<FS_Protocol::request> batch(1, req);
+		std::vector<size_t> payloads(1, pos + header);
+		int length = req.length;
+		pos += total;
+
+		while(c.in.size() - pos >= header) {
+			FS_Protocol::request next;
+			memcpy(&next, &c.in[pos], header);
+
+			const FS_Protocol::request &last = batch.back();
+			if(next.op != req.op || next.inumber != req.inumber || next.offset != last.offset + last.length ||
+			   next.length < 0 || next.length > FS_Protocol::MAX_PAYLOAD - length)
+				break;
+
+			size_t next_total = header + (FS_Protocol::has_payload(next.op) ? next.length : 0);
+			if(c.in.size() - pos < next_total) break;
+
+			batch.push_back(next);
+			payloads.push_back(pos + header);
+			length += next.length;
+			pos += next_total;
+		}
+
+		execute_batch(c, batch, payloads);
+	}
+
+	c.in.erase(c.in.begin(), c.in.begin() + pos);
+}
+
+void FS_Server::execute(client &c, const FS_Protocol::request &req, const std::string &path)
+{
+	int result;
+
+	nrequests++;
+
+	switch(req.op) {
+		case FS_Protocol::OP_FORMAT:
+			result = fs->fs_format(req.flags & FS_Protocol::FLAG_LAZY);
+			break;
+		case FS_Protocol::OP_MOUNT:
+			result = fs->fs_mount(req.inumber);
+			break;
+		case FS_Protocol::OP_UNMOUNT:
+			result = fs->fs_unmount();
+			break;
+		case FS_Protocol::OP_CREATE:
+			if(path.empty()) {
+				result = fs->fs_create(req.flags & FS_Protocol::FLAG_COMPRESSED);
+			} else {
+				result = fs->fs_create_path(path.c_str(), req.flags & FS_Protocol::FLAG_COMPRESSED);
+			}
+			break;
+		case FS_Protocol::OP_DELETE:
+			result = fs->fs_delete(req.inumber);
+			break;
+		case FS_Protocol::OP_GETSIZE:
+			result = fs->fs_getsize(req.inumber);
+			break;
+		case FS_Protocol::OP_LOOKUP:
+			result = fs->fs_lookup(path.c_str());
+			break;
+		case FS_Protocol::OP_MKDIR:
+			result = fs->fs_mkdir(path.c_str());
+			break;
+		case FS_Protocol::OP_UNLINK:
+			result = fs->fs_unlink(path.c_str());
+			break;
+		default:
+			// Operação desconhecida ou leitura/escrita com offset negativo
+			result = -1;
+			break;
+	}
+
+	reply(c, req.id, result);
+}
+
+void FS_Server::execute_batch(client &c, const std::vector<FS_Protocol::request> &batch, const std::vector<size_t> &payloads)
+{
+	const FS_Protocol::request &first = batch[0];
+	bool write = first.op == FS_Protocol::OP_WRITE;
+
+	int length = 0;
+	for(size_t i = 0; i < batch.size(); i++) {
+		length += batch[i].length;
+	}
+
+	std::vector<char> buffer(length);
+	int done;
+
+	if(write) {
+		int pos = 0;
+		for(size_t i = 0; i < batch.size(); i++) {
+			memcpy(buffer.data() + pos, &c.in[payloads[i]], batch[i].length);
+			pos += batch[i].length;
+		}
+		done = length ? fs->fs_write(first.inumber, buffer.data(), length, first.offset) : 0;
+	} else {
+		done = length ? fs->fs_read(first.inumber, buffer.data(), length, first.offset) : 0;
+	}
+
+	nrequests += batch.size();
+	nbatches++;
+
+	// Cada requisição fica com a parte dela do que foi feito
+	int pos = 0;
+	for(size_t i = 0; i < batch.size(); i++) {
+		int result = min(batch[i].length, max(0, done - pos));
+		if(write) {
+			reply(c, batch[i].id, result);
+		} else {
+			reply(c, batch[i].id, result, buffer.data() + pos, result);
+		}
+		pos += batch[i].length;
+	}
+}
+
+void FS_Server::reply(client &c, unsigned int id, int result, const char *data, int length)
+{
+	FS_Protocol::reply rep;
+	rep.id = id;
+	rep.result = result;
+	rep.length = length;
+
+	const char *p = (const char *) &rep;
+	c.out.insert(c.out.end(), p, p + sizeof(rep));
+	if(length > 0) {
+		c.out.insert(c.out.end(), data, data + length);
+	}
+}
+
+// Envia o que der das respostas acumuladas; todas as de uma rodada saem juntas
+void FS_Server::send_pending(client &c)
+{
+	while(!c.failed && c.sent < c.out.size()) {
+		ssize_t result = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+		if(result < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) c.failed = true;
+			break;
+		}
+		c.sent += result;
+	}
+
+	if(c.sent == c.out.size()) {
+		c.out.clear();
+		c.sent = 0;
+	}
+}
@@ -1,9 +1,15 @@
 #include "fs.h"
 #include "disk.h"
+#include "stripe.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 class File_Ops
 {
@@ -12,6 +18,10 @@ public:
 
     static int do_copyout(int inumber, const char *filename, INE5412_FS *fs);
 
+    static int resolve(const char *arg, INE5412_FS *fs);
+    static bool is_number(const char *arg);
+    static bool is_path(const char *arg);
+
 };
 
 using namespace std;
@@ -24,17 +34,48 @@ int main( int argc, char *argv[] )
 	char arg2[1024];
 	int inumber, result, args;
 
-	if(argc != 3) {
-		cout << "use: " << argv[0] << " <diskfile> <nblocks>\n";
+	if(argc < 3 || argc > 5) {
+		cout << "use: " << argv[0] << " <diskfile>[,<diskfile>...] <nblocks> [blocksize] [stripe chunk]\n";
 		return 1;
 	}
 
+	// Várias imagens separadas por vírgula formam um disco distribuído em faixas entre elas
+	std::string diskname = argv[1];
+	std::vector<std::string> filenames;
+	for(char *name = strtok(argv[1], ","); name; name = strtok(NULL, ",")) {
+		filenames.push_back(name);
+	}
 
-    Disk disk(argv[1], atoi(argv[2]));
+	// Sem tamanho de bloco explícito, usa o registrado na imagem (ou o padrão, se ela não está formatada):
+	// no superbloco, no começo da imagem, ou no cabeçalho de cada imagem de um disco distribuído
+	int blocksize = argc >= 4 ? atoi(argv[3]) : (filenames.size() > 1 ? StripedDisk::probe_block_size(filenames[0].c_str())
+	                                           : INE5412_FS::probe_block_size(filenames[0].c_str()));
+	if(!blocksize) blocksize = Disk::DISK_BLOCK_SIZE;
+
+	Disk *disk;
+	if(filenames.size() > 1) {
+		disk = new StripedDisk(filenames, atoi(argv[2]), blocksize, argc == 5 ? atoi(argv[4]) : 0);
+	} else {
+		disk = new Disk(filenames[0].c_str(), atoi(argv[2]), blocksize);
+	}
+	if(!disk->is_open()) {
+		delete disk;
+		return 1;
+	}
 
-    INE5412_FS fs(&disk);
+    INE5412_FS *fs = INE5412_FS::create(disk);
+	if(!fs) {
+		cout << "unsupported block size " << blocksize << " (use a power of two from "
+		     << INE5412_FS::MIN_BLOCK_SIZE << " to " << INE5412_FS::MAX_BLOCK_SIZE << ")\n";
+		delete disk;
+		return 1;
+	}
 
-	cout << "opened emulated disk image " << argv[1] << " with " << disk.size() << " blocks\n";
+	cout << "opened emulated disk image " << diskname << " with " << disk->size() << " blocks of " << blocksize << " bytes";
+	if(filenames.size() > 1) {
+		cout << " striped across " << filenames.size() << " images";
+	}
+	cout << "\n";
 
 	while(1) {
 		cout << " simplefs> ";
@@ -54,110 +95,236 @@ int main( int argc, char *argv[] )
             continue;
 
 		if(!strcmp(cmd, "format")) {
-			if(args == 1) {
-				if(fs.fs_format()) {
+			if(args == 1 || (args == 2 && !strcmp(arg1, "lazy"))) {
+				if(fs->fs_format(args == 2)) {
 					cout << "disk formatted.\n";
 				} else {
 					cout << "format failed!\n";
 				}
 			} else {
-				cout << "use: format\n";
+				cout << "use: format [lazy]\n";
 			}
 		} else if(!strcmp(cmd, "mount")) {
-			if(args == 1) {
-				if(fs.fs_mount()) {
-					cout << "disk mounted.\n";
+			if(args == 1 || args == 2) {
+				if(fs->fs_mount(args == 2 ? atoi(arg1) : -1)) {
+					cout << "disk mounted" << (args == 2 ? " read-only" : "") << ".\n";
 				} else {
 					cout << "mount failed!\n";
 				}
 			} else {
-				cout << "use: mount\n";
+				cout << "use: mount [snapshot]\n";
+			}
+		} else if(!strcmp(cmd, "unmount")) {
+			if(args == 1) {
+				if(fs->fs_unmount()) {
+					cout << "disk unmounted.\n";
+				} else {
+					cout << "unmount failed!\n";
+				}
+			} else {
+				cout << "use: unmount\n";
+			}
+		} else if(!strcmp(cmd, "initinodes")) {
+			if(args == 1 || args == 2) {
+				result = fs->fs_init_inodes(args == 2 ? atoi(arg1) : INT_MAX);
+				if(result >= 0) {
+					cout << result << " inode blocks left to initialize\n";
+				} else {
+					cout << "initinodes failed!\n";
+				}
+			} else {
+				cout << "use: initinodes [count]\n";
 			}
 		} else if(!strcmp(cmd, "debug")) {
 			if(args == 1) {
-				fs.fs_debug();
+				fs->fs_debug();
 			} else {
 				cout << "use: debug\n";
 			}
 		} else if(!strcmp(cmd, "getsize")) {
 			if(args == 2) {
-				inumber = atoi(arg1);
-				result = fs.fs_getsize(inumber);
+				inumber = File_Ops::resolve(arg1, fs);
+				result = fs->fs_getsize(inumber);
 				if(result >= 0) {
 					cout << "inode " << inumber << " has size " << result << "\n";
 				} else {
 					cout << "getsize failed!\n";
 				}
 			} else {
-				cout << "use: getsize <inumber>\n";
+				cout << "use: getsize <inumber|/path>\n";
 			}
 
 		} else if(!strcmp(cmd, "create")) {
-			if(args == 1) {
-				inumber = fs.fs_create();
+			bool compressed = args >= 2 && !strcmp(arg1, "-c");
+			const char *path = args == 3 ? arg2 : (args == 2 && !compressed ? arg1 : NULL);
+			if((args == 1 || args == 2 || (args == 3 && compressed)) && (!path || File_Ops::is_path(path))) {
+				inumber = path ? fs->fs_create_path(path, compressed) : fs->fs_create(compressed);
 				if(inumber > 0) {
 					cout << "created inode " << inumber << "\n";
 				} else {
 					cout << "create failed!\n";
 				}
 			} else {
-				cout << "use: create\n";
+				cout << "use: create [-c] [/path]\n";
+			}
+		} else if(!strcmp(cmd, "mkdir")) {
+			if(args == 2 && File_Ops::is_path(arg1)) {
+				inumber = fs->fs_mkdir(arg1);
+				if(inumber > 0) {
+					cout << "created directory " << arg1 << " (inode " << inumber << ")\n";
+				} else {
+					cout << "mkdir failed!\n";
+				}
+			} else {
+				cout << "use: mkdir </path>\n";
+			}
+		} else if(!strcmp(cmd, "ls")) {
+			std::vector<INE5412_FS::fs_dirent> entries;
+			if(args == 1 || (args == 2 && File_Ops::is_path(arg1))) {
+				if(fs->fs_readdir(args == 2 ? arg1 : "/", entries)) {
+					sort(entries.begin(), entries.end(), [](const INE5412_FS::fs_dirent &a, const INE5412_FS::fs_dirent &b) {
+						return strcmp(a.name, b.name) < 0;
+					});
+					for(size_t i = 0; i < entries.size(); i++) {
+						cout << "    " << entries[i].inumber << "\t" << entries[i].name << "\n";
+					}
+				} else {
+					cout << "ls failed!\n";
+				}
+			} else {
+				cout << "use: ls [/path]\n";
 			}
 		} else if(!strcmp(cmd, "delete")) {
-			if(args == 2) {
+			if(args == 2 && File_Ops::is_number(arg1)) {
 				inumber = atoi(arg1);
-				if(fs.fs_delete(inumber)) {
+				result = fs->fs_delete(inumber);
+				if(result > 0) {
 					cout << "inode " << inumber << " deleted.\n";
+				} else if(result < 0) {
+					cout << "inode " << inumber << " has a name, use: delete </path>\n";
+				} else {
+					cout << "delete failed!\n";
+				}
+			} else if(args == 2 && File_Ops::is_path(arg1)) {
+				if(fs->fs_unlink(arg1)) {
+					cout << arg1 << " deleted.\n";
 				} else {
 					cout << "delete failed!\n";
 				}
 			} else {
-				cout << "use: delete <inumber>\n";
+				cout << "use: delete <inumber|/path>\n";
 			}
 		} else if(!strcmp(cmd, "cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
-				if(!File_Ops::do_copyout(inumber, "/dev/stdout", &fs)) {
+				inumber = File_Ops::resolve(arg1, fs);
+				if(!File_Ops::do_copyout(inumber, "/dev/stdout", fs)) {
 					cout << "cat failed!\n";
 				}
 			} else {
-				cout << "use: cat <inumber>\n";
+				cout << "use: cat <inumber|/path>\n";
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
-				if(File_Ops::do_copyin(arg1, inumber, &fs)) {
+				// Um caminho que ainda não existe vira um arquivo novo
+				inumber = File_Ops::resolve(arg2, fs);
+				if(!inumber && File_Ops::is_path(arg2)) {
+					inumber = fs->fs_create_path(arg2);
+				}
+				if(File_Ops::do_copyin(arg1, inumber, fs)) {
 					cout << "copied file " << arg1 << " to inode " << inumber << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyin <filename> <inumber>\n";
+				cout << "use: copyin <filename> <inumber|/path>\n";
 			}
 
 		} else if(!strcmp(cmd, "copyout")) {
 			if(args == 3) {
-				inumber = atoi(arg1);
-				if(File_Ops::do_copyout(inumber, arg2, &fs)) {
+				inumber = File_Ops::resolve(arg1, fs);
+				if(File_Ops::do_copyout(inumber, arg2, fs)) {
 					cout << "copied inode " << inumber << " to file " << arg2 << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyout <inumber> <filename>\n";
+				cout << "use: copyout <inumber|/path> <filename>\n";
 			}
 
+		} else if(!strcmp(cmd, "defrag")) {
+			if(args == 1 || args == 2) {
+				INE5412_FS::fs_frag_report report;
+				if(fs->fs_fragmentation(&report)) {
+					cout << "before: " << report.files << " files in " << report.extents << " extents, "
+					     << report.free_blocks << " free blocks in " << report.free_extents << " extents\n";
+					result = fs->fs_defrag(args == 2 ? atoi(arg1) : 0);
+					fs->fs_fragmentation(&report);
+					cout << "after:  " << report.files << " files in " << report.extents << " extents, "
+					     << report.free_blocks << " free blocks in " << report.free_extents << " extents\n";
+					cout << result << " blocks moved\n";
+				} else {
+					cout << "defrag failed!\n";
+				}
+			} else {
+				cout << "use: defrag [max_moves]\n";
+			}
+		} else if(!strcmp(cmd, "dedup")) {
+			if(args == 2 && (!strcmp(arg1, "on") || !strcmp(arg1, "off"))) {
+				if(fs->fs_dedup(!strcmp(arg1, "on"))) {
+					cout << "deduplication " << (!strcmp(arg1, "on") ? "enabled" : "disabled") << ".\n";
+				} else {
+					cout << "dedup failed!\n";
+				}
+			} else {
+				cout << "use: dedup <on|off>\n";
+			}
+		} else if(!strcmp(cmd, "checksums")) {
+			if(args == 2 && (!strcmp(arg1, "on") || !strcmp(arg1, "off"))) {
+				if(disk->enable_checksums(!strcmp(arg1, "on"))) {
+					cout << "checksums " << (!strcmp(arg1, "on") ? "enabled" : "disabled") << ".\n";
+				} else {
+					cout << "checksums failed!\n";
+				}
+			} else {
+				cout << "use: checksums <on|off>\n";
+			}
+		} else if(!strcmp(cmd, "snapshot")) {
+			if(args == 1) {
+				result = fs->fs_snapshot_create();
+				if(result >= 0) {
+					cout << "created snapshot " << result << "\n";
+				} else {
+					cout << "snapshot failed!\n";
+				}
+			} else if(args == 3 && !strcmp(arg1, "delete")) {
+				if(fs->fs_snapshot_delete(atoi(arg2))) {
+					cout << "snapshot " << atoi(arg2) << " deleted.\n";
+				} else {
+					cout << "snapshot delete failed!\n";
+				}
+			} else {
+				cout << "use: snapshot [delete <snapshot>]\n";
+			}
 		} else if(!strcmp(cmd, "help")) {
 			cout << "Commands are:\n";
-			cout << "    format\n";
-			cout << "    mount\n";
+			cout << "    format  [lazy]\n";
+			cout << "    mount   [snapshot]\n";
+			cout << "    unmount\n";
+			cout << "    initinodes [count]\n";
 			cout << "    debug\n";
-			cout << "    create\n";
-			cout << "    delete  <inode>\n";
-			cout << "    cat     <inode>\n";
-			cout << "    copyin  <file> <inode>\n";
-			cout << "    copyout <inode> <file>\n";
+			cout << "    getsize <inode|/path>\n";
+			cout << "    create  [-c] [/path]\n";
+			cout << "    mkdir   </path>\n";
+			cout << "    ls      [/path]\n";
+			cout << "    delete  <inode|/path>\n";
+			cout << "    cat     <inode|/path>\n";
+			cout << "    copyin  <file> <inode|/path>\n";
+			cout << "    copyout <inode|/path> <file>\n";
+			cout << "    defrag  [max_moves]\n";
+			cout << "    dedup   <on|off>\n";
+			cout << "    checksums <on|off>\n";
+			cout << "    snapshot [delete <snapshot>]\n";
 			cout << "    help\n";
 			cout << "    quit\n";
 			cout << "    exit\n";
@@ -173,69 +340,88 @@ int main( int argc, char *argv[] )
 	}
 
 	cout << "closing emulated disk.\n";
-	disk.close();
+	disk->close();
+	delete fs;
+	delete disk;
 
 	return 0;
 }
 
 int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int fd, result;
+	struct stat st;
 
-	file = fopen(filename, "r");
-	if(!file) {
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
 		cout << "couldn't open " << filename << "\n";
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result <= 0) break;
-		if(result > 0) {
-			actual = fs->fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				cout << "ERROR: fs_write return invalid result " << actual << "\n";
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				cout << "WARNING: fs_write only wrote " << actual << " bytes, not " << result << " bytes\n";
-				break;
-			}
-		}
+	result = fs->fs_import(inumber, fd);
+	if(result < 0) {
+		cout << "ERROR: fs_import return invalid result " << result << "\n";
+		result = 0;
+	} else if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && result != st.st_size) {
+		cout << "WARNING: fs_import only wrote " << result << " bytes, not " << st.st_size << " bytes\n";
 	}
 
-	cout << offset << " bytes copied\n";
+	cout << result << " bytes copied\n";
 
-    fclose(file);
+	close(fd);
 
 	return 1;
 }
 
 int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 {
-	FILE *file;
-	int offset = 0, result;
-	char buffer[16384];
+	int fd, result;
+
+	// Esvazia o que já foi impresso, já que a cópia escreve direto no descritor
+	fflush(stdout);
 
-	file = fopen(filename,"w");
-	if(!file) {
+	if(!strcmp(filename, "/dev/stdout")) {
+		fd = dup(STDOUT_FILENO);
+	} else {
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if(fd < 0) {
 		cout << "couldn't open " << filename << "\n";
 		return 0;
 	}
 
-	while(1) {
-		result = fs->fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+	result = fs->fs_export(inumber, fd);
+	close(fd);
+
+	if(result < 0) {
+		return 0;
 	}
 
-	cout << offset << " bytes copied\n";
+	cout << result << " bytes copied\n";
 
-	fclose(file);
 	return 1;
 }
 
+bool File_Ops::is_number(const char *arg)
+{
+	if(!*arg) return false;
+	for(; *arg; arg++) {
+		if(*arg < '0' || *arg > '9') return false;
+	}
+	return true;
+}
+
+// Caminhos começam sempre com '/', de modo que um nome só de dígitos não se confunde com um inumber
+bool File_Ops::is_path(const char *arg)
+{
+	return *arg == '/';
+}
+
+// Argumento que começa com '/' é um caminho (retorna 0 se ele não existe); qualquer outro é um inumber
+int File_Ops::resolve(const char *arg, INE5412_FS *fs)
+{
+	if(is_path(arg)) {
+		return fs->fs_lookup(arg);
+	}
+	return atoi(arg);
+}
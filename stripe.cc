@@ -0,0 +1,273 @@
+#include "stripe.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+StripedDisk::StripedDisk(const std::vector<std::string> &filenames, int n, int bs, int c)
+{
+	nblocks = n;
+	blocksize = bs;
+	valid = false;
+
+	// Sem chunk explícito, usa o que foi gravado quando o conjunto foi criado
+	stripe_header header;
+	if(c <= 0)
+		c = read_header(filenames[0].c_str(), header) ? header.chunk : 1;
+	chunk = c;
+
+	// Cada imagem guarda uma faixa de chunk blocos a cada volta pelas imagens, depois do cabeçalho
+	int stripe = filenames.size() * chunk;
+	int member_blocks = (n + stripe - 1) / stripe * chunk;
+
+	for(size_t i = 0; i < filenames.size(); i++) {
+		members.push_back(new Disk(filenames[i].c_str(), member_blocks + 1, bs));
+		members[i]->set_verbose(false);
+		if(!members[i]->is_open())
+			return;
+	}
+
+	valid = check_headers(filenames);
+}
+
+StripedDisk::~StripedDisk()
+{
+	for(size_t i = 0; i < members.size(); i++) {
+		delete members[i];
+	}
+}
+
+// Lê o cabeçalho do começo da imagem (retorna 0 se ela não faz parte de um disco distribuído)
+int StripedDisk::read_header(const char *filename, stripe_header &header)
+{
+	FILE *file = fopen(filename, "r");
+	if(!file)
+		return 0;
+
+	int result = fread(&header, sizeof(header), 1, file);
+	fclose(file);
+
+	return result == 1 && header.magic == STRIPE_MAGIC;
+}
+
+// Tamanho de bloco registrado no cabeçalho da imagem (0 se ela não tem cabeçalho)
+int StripedDisk::probe_block_size(const char *filename)
+{
+	stripe_header header;
+	return read_header(filename, header) ? header.blocksize : 0;
+}
+
+// Confere se cada imagem está na posição e com a geometria com que o conjunto foi criado.
+// Se todas são novas (bloco 0 zerado), grava o cabeçalho em cada uma
+int StripedDisk::check_headers(const std::vector<std::string> &filenames)
+{
+	vector<char> buffer(blocksize);
+	stripe_header header;
+	size_t fresh = 0;
+
+	for(size_t i = 0; i < members.size(); i++) {
+		members[i]->read(0, buffer.data());
+		memcpy(&header, buffer.data(), sizeof(header));
+
+		if(header.magic != STRIPE_MAGIC) {
+			if(count(buffer.begin(), buffer.end(), 0) == blocksize) {
+				fresh++;
+				continue;
+			}
+			cout << "ERROR: " << filenames[i] << " is not part of a striped disk\n";
+			return 0;
+		}
+
+		if(header.nmembers != (int) members.size() || header.index != (int) i ||
+		   header.chunk != chunk || header.blocksize != blocksize) {
+			cout << "ERROR: " << filenames[i] << " is image " << header.index << " of " << header.nmembers
+			     << " striped with chunk " << header.chunk << " and " << header.blocksize << "-byte blocks\n";
+			return 0;
+		}
+	}
+
+	if(fresh == 0)
+		return 1;
+
+	if(fresh != members.size()) {
+		cout << "ERROR: striped disk mixes new images with images of another set\n";
+		return 0;
+	}
+
+	for(size_t i = 0; i < members.size(); i++) {
+		fill(buffer.begin(), buffer.end(), 0);
+		header.magic = STRIPE_MAGIC;
+		header.nmembers = members.size();
+		header.index = i;
+		header.chunk = chunk;
+		header.blocksize = blocksize;
+		memcpy(buffer.data(), &header, sizeof(header));
+		members[i]->write(0, buffer.data());
+	}
+
+	return 1;
+}
+
+// Imagem e bloco dentro dela onde fica o bloco lógico blocknum
+void StripedDisk::locate(int blocknum, int &member, int &memberblock)
+{
+	int n = members.size();
+	int c = blocknum / chunk;
+
+	member = c % n;
+	memberblock = (c / n) * chunk + blocknum % chunk + 1;
+}
+
+void StripedDisk::read(int blocknum, char *data)
+{
+	int member, memberblock;
+
+	sanity_check(blocknum, data);
+	locate(blocknum, member, memberblock);
+	members[member]->read(memberblock, data);
+}
+
+void StripedDisk::write(int blocknum, const char *data)
+{
+	int member, memberblock;
+
+	sanity_check(blocknum, data);
+	locate(blocknum, member, memberblock);
+	members[member]->write(memberblock, data);
+}
+
+// Divide a transferência em trechos que não cruzam o fim de uma faixa
+void StripedDisk::split(int blocknum, int length, off_t fdoffset, std::vector<piece> &pieces)
+{
+	for(int pos = 0; pos < length;) {
+		int b = blocknum + pos / blocksize;
+		int run = (chunk - b % chunk) * blocksize;
+
+		piece p;
+		locate(b, p.member, p.blocknum);
+		p.length = min(run, length - pos);
+		p.fdoffset = fdoffset + pos;
+		p.done = 0;
+
+		pieces.push_back(p);
+		pos += p.length;
+	}
+}
+
+int StripedDisk::transfer(int blocknum, int length, int fd, off_t *fdoffset, bool to_fd)
+{
+	int count = (length + blocksize - 1) / blocksize;
+
+	sanity_check(blocknum, &fd);
+	sanity_check(blocknum + count - 1, &fd);
+
+	// Com uma posição explícita em fd cada imagem pode trabalhar independente das outras;
+	// se fd não permite posicionar (pipe, terminal), os trechos vão em ordem, um de cada vez.
+	// Com O_APPEND o Linux ignora a posição de pwrite e acrescenta no fim, então a escrita também vai em ordem
+	off_t base = fdoffset ? *fdoffset : lseek(fd, 0, SEEK_CUR);
+	bool sequential = base < 0 || members.size() == 1 || (to_fd && (fcntl(fd, F_GETFL) & O_APPEND));
+
+	std::vector<piece> pieces;
+	split(blocknum, length, base < 0 ? 0 : base, pieces);
+
+	int done = 0;
+
+	if(sequential) {
+		for(size_t i = 0; i < pieces.size(); i++) {
+			piece &p = pieces[i];
+			Disk *d = members[p.member];
+			int result = to_fd ? d->export_blocks(p.blocknum, p.length, fd, fdoffset)
+			                   : d->import_blocks(p.blocknum, p.length, fd, fdoffset);
+			if(result > 0) done += result;
+			if(result != p.length) break;
+		}
+		return done;
+	}
+
+	std::vector<std::thread> workers;
+
+	for(size_t m = 0; m < members.size(); m++) {
+		workers.push_back(std::thread([&, m]() {
+			for(size_t i = 0; i < pieces.size(); i++) {
+				piece &p = pieces[i];
+				if(p.member != (int) m) continue;
+
+				off_t offset = p.fdoffset;
+				p.done = to_fd ? members[m]->export_blocks(p.blocknum, p.length, fd, &offset)
+				               : members[m]->import_blocks(p.blocknum, p.length, fd, &offset);
+				if(p.done != p.length) break;
+			}
+		}));
+	}
+
+	for(size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+
+	// Só conta o que foi transferido sem lacunas desde o início
+	for(size_t i = 0; i < pieces.size(); i++) {
+		if(pieces[i].done > 0) done += pieces[i].done;
+		if(pieces[i].done != pieces[i].length) break;
+	}
+
+	if(fdoffset) {
+		*fdoffset = base + done;
+	} else {
+		lseek(fd, base + done, SEEK_SET);
+	}
+
+	return done;
+}
+
+int StripedDisk::export_blocks(int blocknum, int length, int fd, off_t *fdoffset)
+{
+	return transfer(blocknum, length, fd, fdoffset, true);
+}
+
+int StripedDisk::import_blocks(int blocknum, int length, int fd, off_t *fdoffset)
+{
+	return transfer(blocknum, length, fd, fdoffset, false);
+}
+
+// Cada imagem guarda os checksums dos próprios blocos
+int StripedDisk::enable_checksums(bool enable)
+{
+	for(size_t i = 0; i < members.size(); i++) {
+		if(!members[i]->enable_checksums(enable))
+			return 0;
+	}
+	return 1;
+}
+
+void StripedDisk::close()
+{
+	int reads = 0, writes = 0;
+	long long verified = 0, verify_ns = 0;
+	bool open = false;
+
+	// As imagens fecham em silêncio; o total de todas é mostrado uma vez só
+	for(size_t i = 0; i < members.size(); i++) {
+		if(members[i]->is_open()) {
+			open = true;
+			members[i]->close();
+			reads += members[i]->read_count();
+			writes += members[i]->write_count();
+			verified += members[i]->verify_count();
+			verify_ns += members[i]->verify_time_ns();
+		}
+	}
+
+	if(open && valid) {
+		cout << reads << " disk block reads\n";
+		cout << writes << " disk block writes\n";
+		if(verified)
+			cout << verified << " checksum verifications (" << verify_ns / 1000 << " us)\n";
+	}
+	valid = false;
+}
+
+bool StripedDisk::is_open()
+{
+	return valid;
+}
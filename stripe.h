@@ -0,0 +1,65 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include "disk.h"
+#include <string>
+#include <vector>
+
+// Disco formado por várias imagens: os blocos lógicos são distribuídos em faixas de chunk blocos,
+// uma imagem de cada vez (chunk = 1 é round-robin puro). Transferências de vários blocos são
+// divididas por imagem e feitas em paralelo, uma thread por imagem; read e write de um bloco só
+// vão direto para a imagem que o guarda, sem threads. O bloco 0 de cada imagem guarda a geometria
+// do conjunto, conferida ao abrir, e os blocos lógicos começam no bloco 1.
+class StripedDisk : public Disk
+{
+public:
+    static const unsigned int STRIPE_MAGIC = 0x5791be0d;
+
+    // chunk = 0 usa o registrado nas imagens (ou 1, se elas são novas)
+    StripedDisk(const std::vector<std::string> &filenames, int nblocks, int blocksize = DISK_BLOCK_SIZE, int chunk = 0);
+    ~StripedDisk();
+
+    static int probe_block_size(const char *filename);
+
+    void read(int blocknum, char * data);
+    void write(int blocknum, const char * data);
+    int  export_blocks(int blocknum, int length, int fd, off_t *fdoffset = NULL);
+    int  import_blocks(int blocknum, int length, int fd, off_t *fdoffset = NULL);
+    int  enable_checksums(bool enable);
+    void close();
+    bool is_open();
+
+private:
+    // Cabeçalho no bloco 0 de cada imagem
+    class stripe_header {
+        public:
+            unsigned int magic;
+            int nmembers;
+            int index; // Posição desta imagem no conjunto
+            int chunk;
+            int blocksize;
+    };
+
+    // Trecho contíguo de uma transferência que cai inteiro numa mesma imagem
+    class piece {
+        public:
+            int member;
+            int blocknum;
+            int length;
+            off_t fdoffset;
+            int done;
+    };
+
+    static int read_header(const char *filename, stripe_header &header);
+    int check_headers(const std::vector<std::string> &filenames);
+    void locate(int blocknum, int &member, int &memberblock);
+    void split(int blocknum, int length, off_t fdoffset, std::vector<piece> &pieces);
+    int transfer(int blocknum, int length, int fd, off_t *fdoffset, bool to_fd);
+
+private:
+    std::vector<Disk *> members;
+    int chunk;
+    bool valid; // Imagens abertas e com a geometria conferida
+};
+
+#endif